@@ -23,17 +23,36 @@ typedef struct {
     size_t len;
     size_t cap;
     size_t cur;
+    // data is owned by someone else and can't be reallocated. if it needs to grow, its contents move to a new heap allocation and `overflowed` is set
+    uint8_t fixed;
+    uint8_t overflowed;
 } byte_buffer;
 
+static inline void bytes_grow(byte_buffer * buf)
+{
+    if (buf->fixed)
+    {
+        uint8_t * next = (uint8_t *)BUF_REALLOC(0, buf->cap);
+        assert(next);
+        memcpy(next, buf->data, buf->len);
+        buf->data = next;
+        buf->fixed = 0;
+        buf->overflowed = 1;
+        return;
+    }
+    uint8_t * next = (uint8_t *)BUF_REALLOC(buf->data, buf->cap);
+    assert(next);
+    buf->data = next;
+}
 static inline void bytes_reserve(byte_buffer * buf, size_t extra)
 {
+    if (buf->data && buf->len + extra <= buf->cap)
+        return;
     if (buf->cap < 8)
         buf->cap = 8;
     while (buf->len + extra >= buf->cap)
         buf->cap <<= 1;
-    uint8_t * next = (uint8_t *)BUF_REALLOC(buf->data, buf->cap);
-    assert(next);
-    buf->data = next;
+    bytes_grow(buf);
     if (!buf->data)
         buf->cap = 0;
 }
@@ -44,9 +63,7 @@ static inline void byte_push(byte_buffer * buf, uint8_t byte)
         buf->cap = buf->cap << 1;
         if (buf->cap < 8)
             buf->cap = 8;
-        uint8_t * next = (uint8_t *)BUF_REALLOC(buf->data, buf->cap);
-        assert(next);
-        buf->data = next;
+        bytes_grow(buf);
     }
     buf->data[buf->len] = byte;
     buf->len += 1;
@@ -48,6 +48,10 @@ typedef struct {
     uint32_t * prevlink;
     uint32_t max_distance;
     uint16_t chain_len;
+    uint64_t min_pos; // matches can't start before this stream position (see defl_stream_flush)
+    // positions are stored plus `base`, so that entries left over from earlier streams that used the same tables (which are all below it) count as empty
+    //  instead of the tables having to be cleared for every stream (see defl_stream_reset)
+    uint32_t base;
 } defl_hashmap;
 
 const size_t defl_prevlink_mask = ((1<<DEFL_PREVLINK_SIZE) - 1);
@@ -78,21 +82,29 @@ static inline void hashmap_insert(defl_hashmap * hashmap, const uint8_t * bytes,
 {
     const uint32_t key = hashmap_hash(bytes);
     hashmap->prevlink[defl_hashlink_index(value)] = hashmap->hashtable[key];
-    hashmap->hashtable[key] = value;
+    hashmap->hashtable[key] = (uint32_t)value + hashmap->base;
+}
+
+// the low 32 bits of the position in a hashtable or prevlink entry, or 0 (empty) if it's from an earlier stream
+static inline uint32_t hashmap_entry(const defl_hashmap * hashmap, uint32_t entry)
+{
+    return entry < hashmap->base ? 0 : entry - hashmap->base;
 }
 
 // bytes must point to four characters and be inside of buffer
-static inline uint64_t hashmap_get(defl_hashmap * hashmap, size_t i, const uint8_t * input, const size_t buffer_len, const size_t pre_context, uint64_t * min_len, size_t * back_distance)
+// `i` and `buffer_len` are relative to `input`, which holds the stream starting at position `input_start`
+// the hashmap holds stream positions, and so does the return value
+static inline uint64_t hashmap_get(defl_hashmap * hashmap, size_t i, const uint8_t * input, const uint64_t input_start, const size_t buffer_len, const size_t pre_context, uint64_t * min_len, size_t * back_distance)
 {
     uint64_t remaining = buffer_len - i;
     if (i >= buffer_len || remaining <= DEFL_HASH_SIZE)
         return -1;
 
     const uint32_t key = hashmap_hash(&input[i]);
-    uint64_t value = hashmap->hashtable[key];
-    // file might be more than 4gb, so map in the upper bits of the current address
-    if (sizeof(size_t) > sizeof(uint32_t))
-        value |= i & 0xFFFFFFFF00000000;
+    const uint64_t pos = input_start + i;
+    uint64_t value = hashmap_entry(hashmap, hashmap->hashtable[key]);
+    // stream might be more than 4gb, so map in the upper bits of the current position
+    value |= pos & 0xFFFFFFFF00000000;
     if (!value)
         return -1;
     
@@ -107,22 +119,21 @@ static inline uint64_t hashmap_get(defl_hashmap * hashmap, size_t i, const uint8
     uint16_t chain_len = hashmap->chain_len;
     while (chain_len-- > 0)
     {
-        if (i - value > hashmap->max_distance)
+        if (pos - value > hashmap->max_distance || value < hashmap->min_pos)
             break;
-        if (memcmp(&input[i], &input[value], lz77_min_lookback_length) == 0 && input[i + best_size] == input[value + best_size])
+        if (memcmp(&input[i], &input[value - input_start], lz77_min_lookback_length) == 0 && input[i + best_size] == input[value - input_start + best_size])
         {
             uint64_t size = 0;
             
             size_t d = 1;
-            while (value > 0 && input[i - d] == input[value - 1] && d <= pre_context && d < 200)
+            while (value > input_start && value > hashmap->min_pos && input[i - d] == input[value - input_start - 1] && d <= pre_context && d < 200)
             {
                 value -= 1;
-                remaining += 1;
                 d += 1;
             }
             d -= 1;
             
-            while (size + d < 258 && size < remaining && input[i + size] == input[value + d + size])
+            while (size + d < 258 && size < remaining && input[i + size] == input[value - input_start + d + size])
                 size += 1;
             
             if (size > 258 - d)
@@ -139,13 +150,15 @@ static inline uint64_t hashmap_get(defl_hashmap * hashmap, size_t i, const uint8
                     break;
             }
         }
-        value = hashmap->prevlink[defl_hashlink_index(value)];
-        if (sizeof(size_t) > sizeof(uint32_t))
-            value |= i & 0xFFFFFFFF00000000;
+        value = hashmap_entry(hashmap, hashmap->prevlink[defl_hashlink_index(value)]);
+        value |= pos & 0xFFFFFFFF00000000;
         
-        if (value == 0 || value > i || value == first_value)
+        if (value == 0 || value > pos || value == first_value)
             break;
-        const uint32_t key_2 = hashmap_hash(&input[value]);
+        // don't look at data that has already left the window
+        if (pos - value > hashmap->max_distance || value < hashmap->min_pos)
+            break;
+        const uint32_t key_2 = hashmap_hash(&input[value - input_start]);
         if (key_2 != key)
             break;
     }
@@ -192,6 +205,22 @@ static void push_code(huff_node_t * node, uint8_t bit)
         push_code(node->children[1], bit);
 }
 
+// sets the code length of every node under `node` as if no code could be longer than 15 bits,
+//  and counts the leaves that would have been longer
+static void limit_code_lens(huff_node_t * node, uint8_t len, uint32_t * overflow)
+{
+    node->code_len = len;
+    for (uint8_t i = 0; i < 2; i += 1)
+    {
+        huff_node_t * child = node->children[i];
+        if (!child)
+            continue;
+        if (!child->children[0] && !child->children[1] && len + 1 > 15)
+            *overflow += 1;
+        limit_code_lens(child, len + 1 > 15 ? 15 : len + 1, overflow);
+    }
+}
+
 static int count_compare(const void * a, const void * b)
 {
     int64_t n = *((int64_t*)b) - *((int64_t*)a);
@@ -357,6 +386,39 @@ size_t gen_canonical_code(uint64_t * counts, huff_node_t ** unordered_dict, huff
         }
     }
     
+    // The minimum frequency above usually keeps codes within 15 bits, but not always: frequencies that grow like the fibonacci
+    //  sequence make a tree about 1.44 times deeper than log2 of the frequency ratio. If that happened, cut the lengths down
+    //  the same way zlib does, and give the longest ones back to the least frequent symbols.
+    if (symbol_count >= 2 && queue[0]->children[0])
+    {
+        uint32_t overflow = 0;
+        limit_code_lens(queue[0], 0, &overflow);
+        if (overflow > 0)
+        {
+            uint16_t len_counts[16] = {0};
+            for (size_t i = 0; i < symbol_count; i += 1)
+                len_counts[unordered_dict[i]->code_len] += 1;
+            // each step moves a leaf down a level, which makes room for two of the leaves that got cut to 15 bits
+            while (overflow > 0)
+            {
+                uint8_t len = 14;
+                while (len_counts[len] == 0)
+                    len -= 1;
+                len_counts[len] -= 1;
+                len_counts[len + 1] += 2;
+                len_counts[15] -= 1;
+                overflow = overflow > 2 ? overflow - 2 : 0;
+            }
+            // unordered_dict is still sorted from most to least frequent
+            size_t i = symbol_count;
+            for (uint8_t len = 15; len > 0; len -= 1)
+            {
+                for (uint16_t n = 0; n < len_counts[len]; n += 1)
+                    unordered_dict[--i]->code_len = len;
+            }
+        }
+    }
+    
     // With the above done, our basic huffman tree is built. Now we need to canonicalize it.
     // Canonicalization algorithms only work on sorted lists. Because of frequency ties, our
     //  code list might not be sorted by code length. Let's fix that by sorting it first.
@@ -549,14 +611,23 @@ static void dist_get_info(size_t dist, uint16_t * arg_code, uint16_t * arg_bit_c
     }
 }
 
-static uint32_t defl_compute_adler32(const uint8_t * data, size_t size)
+static uint32_t defl_update_adler32(uint32_t adler, const uint8_t * data, size_t size)
 {
-    uint32_t a = 1;
-    uint32_t b = 0;
-    for (size_t i = 0; i < size; i += 1)
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (size > 0)
     {
-        a = (a + data[i]) % 65521;
-        b = (b + a) % 65521;
+        // 5552 is the most bytes we can sum before b might overflow 32 bits
+        size_t amount = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < amount; i += 1)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += amount;
+        size -= amount;
     }
     return (b << 16) | a;
 }
@@ -580,120 +651,352 @@ static uint32_t defl_compute_crc32(const uint8_t * data, size_t size, uint32_t i
     return init ^ 0xFFFFFFFF;
 }
 
-// quality level: from -12 to 12, indicates compression quality. 0 means "store without compressing". the higher the quality, the slower.
-static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t quality_level, uint8_t header_mode)
+// Split up into chunks, so that each chunk can have a more ideal huffman code.
+// The chunk size is arbitrary.
+static const uint64_t chunk_max_commands = (1 << 15);
+static const uint64_t chunk_max_literal_count = (1 << 14);
+static const uint64_t chunk_max_source_count = (1 << 20);
+
+// how much already-compressed input the window keeps around for lookback (max distance, plus room for hashmap_get's backwards extension)
+#define DEFL_HISTORY_SIZE (32768 + 1024)
+// how much unread input the compressor wants to have buffered before compressing more of it
+// enough for a literal run, a lazy match, and a full-length match
+#define DEFL_LOOKAHEAD_SIZE (1024)
+
+// worst-case size of the compressed stream for `input_len` bytes of input, at any quality level, including the zlib or gzip header and trailer
+// chunks that would come out bigger than their input are stored instead, so this is the input size plus stored block overhead
+static inline uint64_t defl_bound(uint64_t input_len)
+{
+    // a chunk holds at least chunk_max_literal_count bytes of input (except the last one), and each stored block holds up to 0xFFFF bytes
+    uint64_t chunk_count = input_len / chunk_max_literal_count + 1;
+    uint64_t block_count = input_len / 0xFFFF + chunk_count;
+    // 6 bytes per stored block, plus the final empty block, a gzip header, and a gzip trailer
+    return input_len + block_count * 6 + 6 + 10 + 8;
+}
+
+// streaming compressor. input is buffered in a rolling window that holds the lookback history, the chunk currently being built, and some lookahead,
+//  so memory use doesn't depend on input size.
+// the output is identical to compressing all of the input at once.
+typedef struct {
+    defl_hashmap hashmap;
+    int8_t quality_level;
+    uint8_t header_mode;
+    
+    uint8_t * window;
+    size_t window_cap;
+    size_t window_len;
+    uint64_t window_start; // stream position of window[0]
+    uint64_t i; // stream position of the next byte to compress
+    uint64_t total_in;
+    uint32_t checksum;
+    
+    // state of the chunk currently being built
+    // commands have 4 numbers: size, stream position, lb_size, and distance
+    uint64_t * commands;
+    size_t command_count;
+    uint64_t counts[288];
+    uint64_t dist_counts[32];
+    uint64_t literal_count;
+    uint64_t i_start;
+    
+    bit_buffer out;
+} defl_stream;
+
+// starts a new stream, like defl_stream_init, but keeps the buffers of a stream that was ended with defl_stream_end instead of allocating new ones
+//  (a stream that's all zeroes doesn't have any yet, and gets them allocated)
+static void defl_stream_reset(defl_stream * stream, int8_t quality_level, uint8_t header_mode, bit_buffer out)
 {
+    defl_hashmap * hashmap = &stream->hashmap;
+    uint32_t * hashtable = hashmap->hashtable;
+    uint32_t * prevlink = hashmap->prevlink;
+    uint8_t * window = stream->window;
+    uint64_t * commands = stream->commands;
+    // every position the last stream stored is below this
+    uint64_t base = (uint64_t)hashmap->base + stream->total_in + 1;
+    memset(stream, 0, sizeof(defl_stream));
+    
     if (quality_level > 12)
         quality_level = 12;
     if (quality_level < -12)
         quality_level = -12;
+    stream->quality_level = quality_level;
+    stream->header_mode = header_mode;
+    stream->out = out;
     
-    defl_hashmap hashmap;
-    hashmap.hashtable = (uint32_t *)DEFL_MALLOC(sizeof(uint32_t) * (1 << DEFL_HASH_SIZE));
-    assert(hashmap.hashtable);
-    hashmap.prevlink = (uint32_t *)DEFL_MALLOC(sizeof(uint32_t) * (1 << DEFL_PREVLINK_SIZE));
-    assert(hashmap.prevlink);
-    memset(hashmap.hashtable, 0, sizeof(uint32_t) * (1 << DEFL_HASH_SIZE));
-    memset(hashmap.prevlink, 0, sizeof(uint32_t) * (1 << DEFL_PREVLINK_SIZE));
+    hashmap->hashtable = hashtable ? hashtable : (uint32_t *)DEFL_MALLOC(sizeof(uint32_t) * (1 << DEFL_HASH_SIZE));
+    assert(hashmap->hashtable);
+    hashmap->prevlink = prevlink ? prevlink : (uint32_t *)DEFL_MALLOC(sizeof(uint32_t) * (1 << DEFL_PREVLINK_SIZE));
+    assert(hashmap->prevlink);
+    // the tables only need to be cleared when they're new, or when their entries could wrap around past the base
+    //  (which would leave streams of more than 2gb with fewer matches than they could have, but never wrong ones)
+    if (hashtable && prevlink && base < 0x80000000)
+        hashmap->base = base;
+    else
+    {
+        memset(hashmap->hashtable, 0, sizeof(uint32_t) * (1 << DEFL_HASH_SIZE));
+        memset(hashmap->prevlink, 0, sizeof(uint32_t) * (1 << DEFL_PREVLINK_SIZE));
+    }
     
     int8_t chain_bits = quality_level - 1 + (quality_level < 0);
     if (chain_bits < 0)
         chain_bits = 0;
-    hashmap.chain_len = (1 << chain_bits);
+    hashmap->chain_len = (1 << chain_bits);
     
-    hashmap.max_distance = (1 << (quality_level + 11 + (quality_level < 0)));
-    if (hashmap.max_distance > 32768)
-        hashmap.max_distance = 32768;
+    hashmap->max_distance = (1 << (quality_level + 11 + (quality_level < 0)));
+    if (hashmap->max_distance > 32768)
+        hashmap->max_distance = 32768;
     
     // set up buffers
     
-    bit_buffer ret;
-    memset(&ret, 0, sizeof(bit_buffer));
+    // after sliding, the window holds at most the history, one whole chunk, and the lookahead; leave some room for new input on top of that
+    stream->window_cap = DEFL_HISTORY_SIZE + chunk_max_source_count + DEFL_LOOKAHEAD_SIZE * 4 + (1 << 16);
+    stream->window = window ? window : (uint8_t *)DEFL_MALLOC(stream->window_cap);
+    assert(stream->window);
+    
+    stream->commands = commands ? commands : (uint64_t *)DEFL_MALLOC(sizeof(uint64_t) * chunk_max_commands * 4);
+    assert(stream->commands);
     
+    stream->checksum = header_mode == 1 ? 1 : 0;
+    
+    bit_buffer * ret = &stream->out;
     // zlib
     if (header_mode == 1)
     {
         // standard deflate
-        bits_push(&ret, 0x78, 8);
+        bits_push(ret, 0x78, 8);
         // default compression strength
-        bits_push(&ret, 0x9C, 8);
+        bits_push(ret, 0x9C, 8);
     }
     // gzip
     else if (header_mode >= 2)
     {
         // magic
-        bits_push(&ret, 0x1F, 8);
-        bits_push(&ret, 0x8B, 8);
+        bits_push(ret, 0x1F, 8);
+        bits_push(ret, 0x8B, 8);
         // deflate compression
-        bits_push(&ret, 0x08, 8);
+        bits_push(ret, 0x08, 8);
         // no flags (no filename, comment, header crc, etc)
-        bits_push(&ret, 0x00, 8);
+        bits_push(ret, 0x00, 8);
         // no timestamp
-        bits_push(&ret, 0x00, 32);
+        bits_push(ret, 0x00, 32);
         // fastest (4) compression or maximum (2) compression...???
-        bits_push(&ret, quality_level == 0 ? 4 : 2, 8);
+        bits_push(ret, quality_level == 0 ? 4 : 2, 8);
         // unknown origin filesystem
-        bits_push(&ret, 0xFF, 8);
+        bits_push(ret, 0xFF, 8);
+    }
+}
+
+// quality level: from -12 to 12, indicates compression quality. 0 means "store without compressing". the higher the quality, the slower.
+// compressed data is appended to `out`, which can be empty, or can already contain data (e.g. when writing straight into a file buffer).
+//  if it already contains data, its last byte must be complete (bit_index = 8, byte_index = len - 1).
+static void defl_stream_init(defl_stream * stream, int8_t quality_level, uint8_t header_mode, bit_buffer out)
+{
+    memset(stream, 0, sizeof(defl_stream));
+    defl_stream_reset(stream, quality_level, header_mode, out);
+}
+
+// pushes a non-final stored (uncompressed) block. `amount` must be at most 0xFFFF
+static void defl_push_stored(bit_buffer * ret, const uint8_t * data, size_t amount)
+{
+    bit_push(ret, 0); // not the final chunk
+    bits_push(ret, 0, 2); // uncompressed chunk
+    bits_align_to_byte(ret);
+    bits_push(ret, amount, 16);
+    bits_push(ret, ~amount, 16);
+    
+    bytes_push(&ret->buffer, data, amount);
+    ret->byte_index += amount;
+}
+
+// writes out the chunk that's currently being built, which covers the input up to stream position `i_end`
+static void defl_stream_emit_chunk(defl_stream * stream, uint64_t i_end)
+{
+    bit_buffer * ret = &stream->out;
+    uint64_t * commands = stream->commands;
+    
+    stream->counts[256] = 1;
+    
+    // build huff dictionaries
+    
+    // dict is in order of symbol, including unused symbols
+    // unordered dict is in order of frequency/code
+    
+    // gen_canonical_code clobbers the counts it's given
+    uint64_t counts[288];
+    uint64_t dist_counts[32];
+    memcpy(counts, stream->counts, sizeof(counts));
+    memcpy(dist_counts, stream->dist_counts, sizeof(dist_counts));
+    
+    huff_node_t * unordered_dict[288] = {0};
+    huff_node_t * dict[288] = {0};
+    huff_node_t * root_to_free = 0;
+    gen_canonical_code(counts, unordered_dict, dict, &root_to_free, 288);
+    
+    huff_node_t * dist_unordered_dict[32] = {0};
+    huff_node_t * dist_dict[32] = {0};
+    huff_node_t * dist_root_to_free = 0;
+    gen_canonical_code(dist_counts, dist_unordered_dict, dist_dict, &dist_root_to_free, 32);
+    
+    // if the huffman coded chunk would be bigger than the raw input (e.g. noise), store it instead
+    bit_buffer desc;
+    memset(&desc, 0, sizeof(bit_buffer));
+    huff_write_code_desc(&desc, dict, dist_dict);
+    uint64_t dynamic_bits = 3 + desc.byte_index * 8 + desc.bit_index;
+    free(desc.buffer.data);
+    for (size_t j = 0; j < 286; j++)
+    {
+        if (stream->counts[j] && dict[j])
+            dynamic_bits += stream->counts[j] * (dict[j]->code_len + (j >= 265 && j < 285 ? (j - 261) / 4 : 0));
+    }
+    for (size_t j = 0; j < 30; j++)
+    {
+        if (stream->dist_counts[j] && dist_dict[j])
+            dynamic_bits += stream->dist_counts[j] * (dist_dict[j]->code_len + (j >= 4 ? j / 2 - 1 : 0));
+    }
+    uint64_t source_size = i_end - stream->i_start;
+    // header, alignment padding, and length fields for each stored block
+    uint64_t stored_bits = source_size * 8 + (source_size / 0xFFFF + 1) * 42;
+    
+    if (stored_bits < dynamic_bits)
+    {
+        const uint8_t * source = &stream->window[stream->i_start - stream->window_start];
+        for (uint64_t j = 0; j < source_size; j += 0xFFFF)
+            defl_push_stored(ret, &source[j], source_size - j < 0xFFFF ? source_size - j : 0xFFFF);
+        
+        if (root_to_free)
+            free_huff_nodes(root_to_free);
+        if (dist_root_to_free)
+            free_huff_nodes(dist_root_to_free);
+        stream->command_count = 0;
+        return;
     }
     
-    uint32_t checksum = header_mode ? header_mode == 1 ? defl_compute_adler32(input, input_len) : defl_compute_crc32(input, input_len, 0) : 0;
+    //printf("chunk starting at %08X:%d\n", ret->byte_index, ret->bit_index);
+    
+    bit_push(ret, 0); // not the final chunk
+    bits_push(ret, 2, 2); // dynamic huffman chunk
+    
+    huff_write_code_desc(ret, dict, dist_dict);
+    
+    //printf("huff desc ended at %08X:%d\n", ret->byte_index, ret->bit_index);
+    
+    for (size_t j = 0; j < stream->command_count; j++)
+    {
+        uint64_t size    = commands[j * 4 + 0];
+        uint64_t lb_size = commands[j * 4 + 2];
+        uint64_t dist    = commands[j * 4 + 3];
+        
+        // push literals
+        if (size != 0)
+        {
+            //if (j < 8 &&  0x000332CC)
+            //    printf("producing lookback with size %d and dist %d\n", lb_size, dist);
+            
+            const uint8_t * start = &stream->window[commands[j * 4 + 1] - stream->window_start];
+            const uint8_t * end = start + size;
+            while (start < end)
+            {
+                huff_node_t * node = dict[*(start++)];
+                bits_push(ret, node->code, node->code_len);
+            }
+        }
+        
+        if (dist != 0) // lookback
+        {
+            uint16_t size_code = 0;
+            uint16_t size_bit_count = 0;
+            uint16_t size_bits = 0;
+            len_get_info(lb_size, &size_code, &size_bit_count, &size_bits);
+            
+            huff_node_t * size_node = dict[size_code];
+            bits_push(ret, size_node->code, size_node->code_len);
+            bits_push(ret, size_bits, size_bit_count);
+            
+            uint16_t dist_code = 0;
+            uint16_t dist_bit_count = 0;
+            uint16_t dist_bits = 0;
+            dist_get_info(dist, &dist_code, &dist_bit_count, &dist_bits);
+            
+            huff_node_t * dist_node = dist_dict[dist_code];
+            bits_push(ret, dist_node->code, dist_node->code_len);
+            bits_push(ret, dist_bits, dist_bit_count);
+        }
+    }
+    huff_node_t * lit_node = dict[256];
+    //printf("pushing code 0x%X with length %d\n", lit_node->code, lit_node->code_len);
+    bits_push(ret, lit_node->code, lit_node->code_len);
     
-    uint64_t i = 0;
-    // Split up into chunks, so that each chunk can have a more ideal huffman code.
-    // The chunk size is arbitrary.
-    // Each chunk is prefixed with a byte-aligned 32-bit integer giving the number of output tokens in the chunk.
+    //printf("chunk ended at %08X:%d\n", ret->byte_index, ret->bit_index);
     
-    uint64_t chunk_max_commands = (1 << 15);
-    uint64_t chunk_max_literal_count = (1 << 14);
-    uint64_t chunk_max_source_count = (1 << 20);
+    if (root_to_free)
+        free_huff_nodes(root_to_free);
+    if (dist_root_to_free)
+        free_huff_nodes(dist_root_to_free);
     
-    // commands have 4 numbers: size, pointer, lb_size, and distance
-    uint64_t * commands = (uint64_t *)DEFL_MALLOC(sizeof(uint64_t) * chunk_max_commands * 4);
-    assert(commands);
-    size_t command_count = 0;
+    stream->command_count = 0;
+    //puts("-- ending compressed block!");
+}
+
+// compresses as much of the buffered input as possible
+// unless `finish` is set, stops early if there isn't enough lookahead buffered to make the same decisions as if all input was available at once
+static void defl_stream_compress(defl_stream * stream, uint8_t finish)
+{
+    defl_hashmap * hashmap = &stream->hashmap;
+    bit_buffer * ret = &stream->out;
+    uint64_t * commands = stream->commands;
+    const uint8_t * input = stream->window;
+    const uint64_t input_start = stream->window_start;
+    const uint64_t input_len = stream->window_start + stream->window_len;
+    const size_t window_len = stream->window_len;
+    uint64_t i = stream->i;
     
     // store only
-    if (quality_level == 0)
+    if (stream->quality_level == 0)
     {
-        while (i < input_len)
+        while (input_len - i >= 0xFFFF || (finish && i < input_len))
         {
-            bit_push(&ret, 0); // not the final chunk
-            bits_push(&ret, 0, 2); // uncompressed chunk
-            bits_align_to_byte(&ret);
             size_t amount = input_len - i;
             if (amount > 0xFFFF)
                 amount = 0xFFFF;
-            bits_push(&ret, amount, 16);
-            bits_push(&ret, ~amount, 16);
-            
-            bytes_push(&ret.buffer, &input[i], amount);
-            ret.byte_index += amount;
+            defl_push_stored(ret, &input[i - input_start], amount);
             i += amount;
         }
-        
+        stream->i = i;
+        return;
     }
+    
     while (i < input_len)
     {
-        uint64_t lb_size = 0;
-        uint64_t lb_loc = 0;
-        
-        memset(commands, 0, sizeof(uint64_t) * chunk_max_commands * 4);
-        command_count = 0;
-        
-        uint64_t counts[288] = {0};
-        uint64_t dist_counts[32] = {0};
+        if (stream->command_count == 0)
+        {
+            memset(stream->counts, 0, sizeof(stream->counts));
+            memset(stream->dist_counts, 0, sizeof(stream->dist_counts));
+            stream->literal_count = 0;
+            stream->i_start = i;
+        }
         
-        uint64_t literal_count = 0;
-        size_t i_start = i;
-        while (i < input_len && command_count < chunk_max_commands && literal_count < chunk_max_literal_count && i - i_start < chunk_max_source_count)
+        uint64_t * counts = stream->counts;
+        uint64_t * dist_counts = stream->dist_counts;
+        size_t command_count = stream->command_count;
+        while (i < input_len && command_count < chunk_max_commands && stream->literal_count < chunk_max_literal_count && i - stream->i_start < chunk_max_source_count)
         {
+            if (!finish && i + DEFL_LOOKAHEAD_SIZE > input_len)
+            {
+                stream->command_count = command_count;
+                stream->i = i;
+                return;
+            }
+            
+            uint64_t lb_size = 0;
+            uint64_t lb_loc = 0;
+            
             // store a literal if we found no lookback
             uint64_t size = 0;
             while (i + size < input_len && size < 258)
             {
                 size_t back_distance = 0;
                 if (i + size + DEFL_HASH_LENGTH < input_len)
-                    lb_loc = hashmap_get(&hashmap, i + size, input, input_len, size, &lb_size, &back_distance);
+                    lb_loc = hashmap_get(hashmap, i + size - input_start, input, input_start, window_len, size, &lb_size, &back_distance);
                 if (lb_size != 0)
                 {
                     // zlib-style "lazy" search: only confirm the match if the next byte isn't a good match too
@@ -701,7 +1004,7 @@ static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t q
                     {
                         uint64_t lb_size_2 = 0;
                         size_t back_distance_2 = 0;
-                        uint64_t lb_loc_2 = hashmap_get(&hashmap, i + size + 1, input, input_len, size + 1, &lb_size_2, &back_distance_2);
+                        uint64_t lb_loc_2 = hashmap_get(hashmap, i + size + 1 - input_start, input, input_start, window_len, size + 1, &lb_size_2, &back_distance_2);
                         if (lb_size_2 >= lb_size + 1)
                         {
                             size += 1;
@@ -718,7 +1021,7 @@ static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t q
                 }
                 // need to update the hashmap mid-literal
                 if (i + size + DEFL_HASH_LENGTH < input_len)
-                    hashmap_insert(&hashmap, &input[i + size], i + size);
+                    hashmap_insert(hashmap, &input[i + size - input_start], i + size);
                 size += 1;
             }
             
@@ -726,18 +1029,20 @@ static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t q
             if (lb_size > 258)
                 lb_size = 258;
             
-            literal_count += size;
+            stream->literal_count += size;
+            
+            commands[command_count * 4 + 0] = size;
+            commands[command_count * 4 + 1] = i;
+            commands[command_count * 4 + 2] = 0;
+            commands[command_count * 4 + 3] = 0;
             
             // check for literal
             if (size != 0)
             {
                 //printf("producing literal with size %d\n", size);
-                commands[command_count * 4 + 0] = size;
-                commands[command_count * 4 + 1] = (uint64_t)&input[i];
-                
                 size_t end = i + size;
                 while (i < end)
-                    counts[input[i++]] += 1;
+                    counts[input[(i++) - input_start]] += 1;
             }
             // check for lookback hit
             if (lb_size != 0)
@@ -762,132 +1067,144 @@ static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t q
                 for (size_t j = 1; j < lb_size; j++)
                 {
                     if (i + DEFL_HASH_LENGTH < input_len)
-                        hashmap_insert(&hashmap, &input[i], i);
+                        hashmap_insert(hashmap, &input[i - input_start], i);
                     i += 1;
                 }
                 if (start_i + DEFL_HASH_LENGTH < input_len)
-                    hashmap_insert(&hashmap, &input[start_i], start_i);
-                
-                lb_size = 0;
+                    hashmap_insert(hashmap, &input[start_i - input_start], start_i);
             }
             command_count += 1;
         }
-        counts[256] = 1;
-        
-        // build huff dictionaries
-        
-        // dict is in order of symbol, including unused symbols
-        // unordered dict is in order of frequency/code
-        
-        huff_node_t * unordered_dict[288] = {0};
-        huff_node_t * dict[288] = {0};
-        huff_node_t * root_to_free = 0;
-        gen_canonical_code(counts, unordered_dict, dict, &root_to_free, 288);
-        
-        huff_node_t * dist_unordered_dict[32] = {0};
-        huff_node_t * dist_dict[32] = {0};
-        huff_node_t * dist_root_to_free = 0;
-        gen_canonical_code(dist_counts, dist_unordered_dict, dist_dict, &dist_root_to_free, 32);
-        
-        //printf("chunk starting at %08X:%d\n", ret.byte_index, ret.bit_index);
-        
-        bit_push(&ret, 0); // not the final chunk
-        bits_push(&ret, 2, 2); // dynamic huffman chunk
-        
-        huff_write_code_desc(&ret, dict, dist_dict);
-        
-        //printf("huff desc ended at %08X:%d\n", ret.byte_index, ret.bit_index);
-        
-        for (size_t j = 0; j < command_count; j++)
-        {
-            uint64_t size    = commands[j * 4 + 0];
-            uint64_t lb_size = commands[j * 4 + 2];
-            uint64_t dist    = commands[j * 4 + 3];
-            
-            // push literals
-            if (size != 0)
-            {
-                //if (j < 8 &&  0x000332CC)
-                //    printf("producing lookback with size %d and dist %d\n", lb_size, dist);
-                
-                uint8_t * start = (uint8_t *)commands[j * 4 + 1];
-                uint8_t * end = start + size;
-                while (start < end)
-                {
-                    huff_node_t * node = dict[*(start++)];
-                    bits_push(&ret, node->code, node->code_len);
-                }
-            }
-            
-            if (dist != 0) // lookback
-            {
-                uint16_t size_code = 0;
-                uint16_t size_bit_count = 0;
-                uint16_t size_bits = 0;
-                len_get_info(lb_size, &size_code, &size_bit_count, &size_bits);
-                
-                huff_node_t * size_node = dict[size_code];
-                bits_push(&ret, size_node->code, size_node->code_len);
-                bits_push(&ret, size_bits, size_bit_count);
-                
-                uint16_t dist_code = 0;
-                uint16_t dist_bit_count = 0;
-                uint16_t dist_bits = 0;
-                dist_get_info(dist, &dist_code, &dist_bit_count, &dist_bits);
-                
-                huff_node_t * dist_node = dist_dict[dist_code];
-                bits_push(&ret, dist_node->code, dist_node->code_len);
-                bits_push(&ret, dist_bits, dist_bit_count);
-            }
-        }
-        huff_node_t * lit_node = dict[256];
-        //printf("pushing code 0x%X with length %d\n", lit_node->code, lit_node->code_len);
-        bits_push(&ret, lit_node->code, lit_node->code_len);
+        stream->command_count = command_count;
         
-        //printf("chunk ended at %08X:%d\n", ret.byte_index, ret.bit_index);
+        defl_stream_emit_chunk(stream, i);
+    }
+    stream->i = i;
+}
+
+// drops input that's no longer needed from the front of the window
+static void defl_stream_slide(defl_stream * stream)
+{
+    uint64_t keep = stream->i;
+    if (stream->quality_level != 0)
+    {
+        keep = stream->i > DEFL_HISTORY_SIZE ? stream->i - DEFL_HISTORY_SIZE : 0;
+        // literals of the chunk being built are still needed
+        if (stream->command_count > 0 && stream->i_start < keep)
+            keep = stream->i_start;
+    }
+    if (keep <= stream->window_start)
+        return;
+    
+    size_t amount = keep - stream->window_start;
+    memmove(stream->window, stream->window + amount, stream->window_len - amount);
+    stream->window_len -= amount;
+    stream->window_start = keep;
+}
+
+// appends input to the stream, compressing it as the window fills up
+static void defl_stream_write(defl_stream * stream, const uint8_t * input, size_t input_len)
+{
+    if (stream->header_mode == 1)
+        stream->checksum = defl_update_adler32(stream->checksum, input, input_len);
+    else if (stream->header_mode >= 2)
+        stream->checksum = defl_compute_crc32(input, input_len, stream->checksum);
+    stream->total_in += input_len;
+    
+    while (input_len > 0)
+    {
+        if (stream->window_len == stream->window_cap)
+            defl_stream_slide(stream);
+        assert(stream->window_len < stream->window_cap);
         
-        if (root_to_free)
-            free_huff_nodes(root_to_free);
-        if (dist_root_to_free)
-            free_huff_nodes(dist_root_to_free);
+        size_t amount = stream->window_cap - stream->window_len;
+        if (amount > input_len)
+            amount = input_len;
+        memcpy(&stream->window[stream->window_len], input, amount);
+        stream->window_len += amount;
+        input += amount;
+        input_len -= amount;
         
-        //puts("-- ending compressed block!");
+        defl_stream_compress(stream, 0);
     }
-    // push an empty chunk at the end with the final chunk flag set
+}
+
+// compresses all buffered input, then byte-aligns the output with an empty stored block (like zlib's Z_SYNC_FLUSH)
+// with `full`, the data after this point also never refers back to the data before it (like zlib's Z_FULL_FLUSH),
+//  so a raw inflater can start decompressing right after the flush point
+static void defl_stream_flush(defl_stream * stream, uint8_t full)
+{
+    defl_stream_compress(stream, 1);
+    defl_push_stored(&stream->out, stream->window, 0);
+    if (full)
+        stream->hashmap.min_pos = stream->i;
+}
+
+// frees the stream's state without finishing its output, e.g. when the output is going to be thrown away
+static void defl_stream_free(defl_stream * stream)
+{
+    DEFL_FREE(stream->hashmap.hashtable);
+    DEFL_FREE(stream->hashmap.prevlink);
+    DEFL_FREE(stream->window);
+    DEFL_FREE(stream->commands);
+}
+
+// compresses any remaining input and writes the end of the stream, but keeps the stream's buffers for defl_stream_reset (see defl_stream_free)
+static void defl_stream_end(defl_stream * stream)
+{
+    defl_stream_compress(stream, 1);
     
+    bit_buffer * ret = &stream->out;
+    // push an empty chunk at the end with the final chunk flag set
     
-    //printf("-- addr %08llX bit %d\n", (unsigned long long)ret.byte_index, ret.bit_index);
-    bit_push(&ret, 1); // final chunk
-    bits_push(&ret, 0, 2); // uncompressed chunk
-    //printf("-- addr %08llX bit %d\n", (unsigned long long)ret.byte_index, ret.bit_index);
-    bits_align_to_byte(&ret);
+    //printf("-- addr %08llX bit %d\n", (unsigned long long)ret->byte_index, ret->bit_index);
+    bit_push(ret, 1); // final chunk
+    bits_push(ret, 0, 2); // uncompressed chunk
+    //printf("-- addr %08llX bit %d\n", (unsigned long long)ret->byte_index, ret->bit_index);
+    bits_align_to_byte(ret);
     
-    //printf("-- addr %08llX\n", (unsigned long long)ret.byte_index);
+    //printf("-- addr %08llX\n", (unsigned long long)ret->byte_index);
     
-    bits_push(&ret, 0, 16); // zero length
-    bits_push(&ret, 0xFFFF, 16); // zero length (one's complement)
+    bits_push(ret, 0, 16); // zero length
+    bits_push(ret, 0xFFFF, 16); // zero length (one's complement)
     
     // zlib
-    if (header_mode == 1)
+    if (stream->header_mode == 1)
     {
-        bits_align_to_byte(&ret);
-        bits_push(&ret, byteswap_int(checksum, 4), 32);
+        bits_align_to_byte(ret);
+        bits_push(ret, byteswap_int(stream->checksum, 4), 32);
     }
     // gzip
-    else if (header_mode >= 2)
+    else if (stream->header_mode >= 2)
     {
-        bits_align_to_byte(&ret);
-        bits_push(&ret, checksum, 32);
-        bits_push(&ret, input_len & 0xFFFFFFFF, 32);
+        bits_align_to_byte(ret);
+        bits_push(ret, stream->checksum, 32);
+        bits_push(ret, stream->total_in & 0xFFFFFFFF, 32);
     }
-    //printf("-- addr %08llX\n", (unsigned long long)ret.byte_index);
+    //printf("-- addr %08llX\n", (unsigned long long)ret->byte_index);
     
     //puts("-- wrote final block!");
+}
+
+// compresses any remaining input, writes the end of the stream, and frees everything except the output
+static void defl_stream_finish(defl_stream * stream)
+{
+    defl_stream_end(stream);
+    defl_stream_free(stream);
+}
+
+// quality level: from -12 to 12, indicates compression quality. 0 means "store without compressing". the higher the quality, the slower.
+static bit_buffer do_deflate(const uint8_t * input, uint64_t input_len, int8_t quality_level, uint8_t header_mode)
+{
+    bit_buffer ret;
+    memset(&ret, 0, sizeof(bit_buffer));
     
-    DEFL_FREE(hashmap.hashtable);
-    DEFL_FREE(hashmap.prevlink);
+    defl_stream stream;
+    defl_stream_init(&stream, quality_level, header_mode, ret);
+    defl_stream_write(&stream, input, input_len);
+    defl_stream_finish(&stream);
     
-    return ret;
+    return stream.out;
 }
 
 #endif // INCL_DEFLATE
@@ -14,12 +14,74 @@
 
 // todo:
 // - text chunks
-// - unknown chunk reading callback
 // - chunk writing hooks
 
+// regression input: fibonacci-like symbol counts used to build a 16-bit huffman code, which deflate can't represent
+static void check_huff_length_limit(void)
+{
+    uint64_t counts[288] = {0};
+    uint64_t a = 1, b = 1;
+    for (size_t i = 0; i < 17; i += 1)
+    {
+        counts[i] = a;
+        uint64_t next = a + b;
+        a = b;
+        b = next;
+    }
+    
+    huff_node_t * unordered_dict[288] = {0};
+    huff_node_t * dict[288] = {0};
+    huff_node_t * root_to_free = 0;
+    gen_canonical_code(counts, unordered_dict, dict, &root_to_free, 288);
+    
+    // every code must fit in 15 bits, and the code must still be complete
+    uint32_t kraft_sum = 0;
+    for (size_t i = 0; i < 288; i += 1)
+    {
+        if (!dict[i] || dict[i]->code_len == 0)
+            continue;
+        assert(dict[i]->code_len <= 15);
+        kraft_sum += 1 << (15 - dict[i]->code_len);
+    }
+    assert(kraft_sum == 1 << 15);
+    
+    if (root_to_free)
+        free_huff_nodes(root_to_free);
+}
+
+typedef struct {
+    size_t reports;
+    uint32_t last_rows;
+} progress_check;
+
+static uint8_t count_progress(void * userdata, const wpng_progress * progress)
+{
+    progress_check * check = (progress_check *)userdata;
+    check->reports += 1;
+    check->last_rows = progress->rows;
+    return 0;
+}
+
+// every successful progressive decode must report at least once, and the last report must cover the whole image
+static void check_progressive(byte_buffer * in_buf, uint32_t flags)
+{
+    progress_check check;
+    memset(&check, 0, sizeof(progress_check));
+    wpng_load_output output;
+    memset(&output, 0, sizeof(wpng_load_output));
+    wpng_load_progressive(in_buf, flags, 16, 1, count_progress, &check, &output);
+    if (output.error == 0)
+    {
+        assert(check.reports > 0);
+        assert(check.last_rows == output.height);
+    }
+    free(output.data);
+}
+
 int main(int argc, char ** argv)
 {
     defl_compute_crc32(0, 0, 0);
+    check_huff_length_limit();
     
     if (argc < 2)
     {
@@ -60,7 +122,11 @@ int main(int argc, char ** argv)
         
         uint8_t * raw_data = (uint8_t *)malloc(file_len);
         fread(raw_data, file_len, 1, f);
-        byte_buffer in_buf = {raw_data, file_len, file_len, 0};
+        byte_buffer in_buf;
+        memset(&in_buf, 0, sizeof(byte_buffer));
+        in_buf.data = raw_data;
+        in_buf.len = file_len;
+        in_buf.cap = file_len;
         
         fclose(f);
         
@@ -75,6 +141,7 @@ int main(int argc, char ** argv)
         flags |= WPNG_READ_SKIP_CRC | WPNG_READ_SKIP_ADLER32;
 #endif
         wpng_load(&in_buf, flags, &output);
+        check_progressive(&in_buf, flags);
         
 #ifdef TEST_VS_LIBPNG
         // skip test if original image has gamma and was 16 bit
@@ -6,8 +6,30 @@
 // wpng_read.h
 
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 
+// adam7 pass geometry
+// index 0 is for non-interlaced images, 1~7 are the adam7 passes
+//  1 6 4 6 2 6 4 6
+//  7 7 7 7 7 7 7 7
+//  5 6 5 6 5 6 5 6
+//  7 7 7 7 7 7 7 7
+//  3 6 4 6 3 6 4 6
+//  7 7 7 7 7 7 7 7
+//  5 6 5 6 5 6 5 6
+//  7 7 7 7 7 7 7 7
+static const uint8_t adam7_y_inits[] = {0, 0, 0, 4, 0, 2, 0, 1};
+static const uint8_t adam7_y_gaps[] = {1, 8, 8, 8, 4, 4, 2, 2};
+static const uint8_t adam7_x_inits[] = {0, 0, 4, 0, 2, 0, 1, 0};
+static const uint8_t adam7_x_gaps[] = {1, 8, 8, 4, 4, 2, 2, 1};
+
+// number of pixels (or rows) a pass covers along an axis of the given size
+static inline size_t adam7_pass_size(size_t size, uint8_t init, uint8_t gap)
+{
+    return (size - init + gap - 1) / gap;
+}
+
 static inline uint8_t paeth_get_ref_raw(int16_t left, int16_t up, int16_t upleft)
 {
     int16_t lin = left + up - upleft;
@@ -0,0 +1,135 @@
+#ifndef WPNG_FILE_INCLUDED
+#define WPNG_FILE_INCLUDED
+
+// you probably want:
+// wpng_read.h
+
+// opens files for wpng_load_file: regular files are memory mapped read-only, so they can be decoded straight out of the page cache,
+//  and everything else (pipes, character devices, small files) is read with plain reads instead
+// uses mmap on unix-likes and file mappings on windows; define WPNG_NO_MMAP to always read, or if neither is available, stdio is used
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if !defined(WPNG_NO_MMAP) && defined(_WIN32)
+#define WPNG_MMAP_WIN32
+#include <windows.h>
+#elif !defined(WPNG_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define WPNG_MMAP_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <stdio.h>
+#endif
+
+// files smaller than this are read instead of mapped, because mapping and unmapping them costs more than copying them
+#ifndef WPNG_MMAP_MIN_SIZE
+#define WPNG_MMAP_MIN_SIZE (1 << 16)
+#endif
+
+typedef struct {
+    const uint8_t * data; // whole file if it's mapped, otherwise null and it has to be read with wpng_file_read
+    size_t size; // if it's known (i.e. for regular files), otherwise 0
+#if defined(WPNG_MMAP_WIN32)
+    HANDLE handle;
+    HANDLE mapping;
+#elif defined(WPNG_MMAP_POSIX)
+    int fd;
+#else
+    FILE * stream;
+#endif
+} wpng_file;
+
+// returns 0 if the file can't be opened
+static uint8_t wpng_file_open(wpng_file * file, const char * path)
+{
+    memset(file, 0, sizeof(wpng_file));
+#if defined(WPNG_MMAP_WIN32)
+    file->handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (file->handle == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    if (GetFileType(file->handle) != FILE_TYPE_DISK || !GetFileSizeEx(file->handle, &size) || (uint64_t)size.QuadPart > SIZE_MAX)
+        return 1;
+    file->size = (size_t)size.QuadPart;
+    if (file->size < WPNG_MMAP_MIN_SIZE)
+        return 1;
+    file->mapping = CreateFileMappingA(file->handle, 0, PAGE_READONLY, 0, 0, 0);
+    if (file->mapping)
+        file->data = (const uint8_t *)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+#elif defined(WPNG_MMAP_POSIX)
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+        return 0;
+    struct stat info;
+    if (fstat(file->fd, &info) != 0 || !S_ISREG(info.st_mode) || (uint64_t)info.st_size > SIZE_MAX)
+        return 1;
+    file->size = (size_t)info.st_size;
+    if (file->size < WPNG_MMAP_MIN_SIZE)
+        return 1;
+    void * data = mmap(0, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (data == MAP_FAILED)
+        return 1;
+    file->data = (const uint8_t *)data;
+    // the decoder mostly goes from the start of the file to the end
+#ifdef MADV_SEQUENTIAL
+    madvise(data, file->size, MADV_SEQUENTIAL);
+#endif
+#else
+    file->stream = fopen(path, "rb");
+    if (!file->stream)
+        return 0;
+#endif
+    return 1;
+}
+
+// reads up to `size` bytes from where the last read stopped; returns how many were read, 0 at the end of the file, or SIZE_MAX on error
+// only for files that aren't mapped
+static size_t wpng_file_read(wpng_file * file, uint8_t * data, size_t size)
+{
+#if defined(WPNG_MMAP_WIN32)
+    DWORD amount = 0;
+    if (size > 0x40000000)
+        size = 0x40000000;
+    if (!ReadFile(file->handle, data, (DWORD)size, &amount, 0))
+        return GetLastError() == ERROR_BROKEN_PIPE ? 0 : SIZE_MAX;
+    return amount;
+#elif defined(WPNG_MMAP_POSIX)
+    while (1)
+    {
+        ssize_t amount = read(file->fd, data, size);
+        if (amount >= 0)
+            return (size_t)amount;
+        if (errno != EINTR)
+            return SIZE_MAX;
+    }
+#else
+    size_t amount = fread(data, 1, size, file->stream);
+    return amount == 0 && ferror(file->stream) ? SIZE_MAX : amount;
+#endif
+}
+
+// only for files that were opened
+static void wpng_file_close(wpng_file * file)
+{
+#if defined(WPNG_MMAP_WIN32)
+    if (file->data)
+        UnmapViewOfFile(file->data);
+    if (file->mapping)
+        CloseHandle(file->mapping);
+    CloseHandle(file->handle);
+#elif defined(WPNG_MMAP_POSIX)
+    if (file->data)
+        munmap((void *)file->data, file->size);
+    close(file->fd);
+#else
+    fclose(file->stream);
+#endif
+    memset(file, 0, sizeof(wpng_file));
+}
+
+#endif //WPNG_FILE_INCLUDED
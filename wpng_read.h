@@ -11,6 +11,18 @@
 #include "inflate.h"
 #include "buffers.h"
 #include "wpng_common.h"
+#include "wpng_thread.h"
+#include "wpng_file.h"
+
+// SSE2 is always there on x86-64; define WPNG_NO_SIMD to only use the plain C row kernels
+#if !defined(WPNG_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define WPNG_SSE2
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#define WPNG_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
 
 #ifndef TEST_VS_LIBPNG
 static double to_srgb(double x)
@@ -22,6 +34,20 @@ static double to_srgb(double x)
 }
 #endif
 
+static double from_srgb(double x)
+{
+    if (x > 0.04045)
+        return pow((x + 0.055) / 1.055, 2.4);
+    else
+        return x / 12.92;
+}
+
+// linear light value of a sample from 0 to 1; gamma is the exponent from the gAMA chunk, or negative if the image is (treated as) sRGB
+static float to_linear(double val, double gamma)
+{
+    return gamma >= 0.0 ? pow(val, gamma) : from_srgb(val);
+}
+
 static uint16_t apply_gamma_u16(uint16_t val, double gamma)
 {
 #ifdef TEST_VS_LIBPNG
@@ -45,198 +71,106 @@ static uint8_t apply_gamma_u8(uint8_t val, double gamma)
 #endif
 }
 
-static void apply_gamma(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, float gamma)
+// gamma tables for 8-bit output are kept for the last few gamma values used, per thread
+#if defined(__cplusplus)
+#define WPNG_THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define WPNG_THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#define WPNG_THREAD_LOCAL __declspec(thread)
+#else
+#define WPNG_THREAD_LOCAL __thread
+#endif
+
+#define WPNG_GAMMA_CACHE_SIZE 4
+
+typedef struct {
+    float gamma;
+    uint8_t valid;
+    uint8_t table[256];
+} wpng_gamma_table;
+
+static const uint8_t * get_gamma_table_u8(float gamma)
 {
-    uint8_t components = bpp;
-    if (is_16bit)
-        components /= 2;
+    static WPNG_THREAD_LOCAL wpng_gamma_table cache[WPNG_GAMMA_CACHE_SIZE];
+    static WPNG_THREAD_LOCAL uint8_t next_entry = 0;
     
-    for (size_t y = 0; y < height; y += 1)
+    for (uint8_t i = 0; i < WPNG_GAMMA_CACHE_SIZE; i += 1)
+    {
+        if (cache[i].valid && cache[i].gamma == gamma)
+            return cache[i].table;
+    }
+    
+    wpng_gamma_table * entry = &cache[next_entry];
+    next_entry = (next_entry + 1) % WPNG_GAMMA_CACHE_SIZE;
+    for (uint32_t val = 0; val < 256; val += 1)
+        entry->table[val] = apply_gamma_u8(val, gamma);
+    entry->gamma = gamma;
+    entry->valid = 1;
+    return entry->table;
+}
+
+// alpha, if there is any, is the last component and is left alone
+static inline void apply_gamma_row_u8(uint8_t * row, uint32_t width, const uint8_t * table, const uint8_t components)
+{
+    const uint8_t color_components = (components == 2 || components == 4) ? components - 1 : components;
+    for (size_t x = 0; x < width; x += 1)
+    {
+        for (uint8_t c = 0; c < color_components; c += 1)
+            row[x * components + c] = table[row[x * components + c]];
+    }
+}
+
+// `table` can be null, in which case every sample is computed on its own
+static void apply_gamma_row_u16(uint8_t * row, uint32_t width, const uint16_t * table, uint8_t components, float gamma)
+{
+    uint8_t color_components = (components == 2 || components == 4) ? components - 1 : components;
+    for (size_t x = 0; x < width; x += 1)
     {
-        for (size_t x = 0; x < width * components; x += 1)
+        for (uint8_t c = 0; c < color_components; c += 1)
         {
-            if ((components == 2 || components == 4) && (x % components == (uint8_t)(components - 1)))
-                continue;
-            if (is_16bit)
-            {
-                uint16_t a = image_data[y * bytes_per_scanline + x * 2 + 0];
-                uint16_t b = image_data[y * bytes_per_scanline + x * 2 + 1];
-                uint16_t val = (a << 8) | b;
-                val = apply_gamma_u16(val, gamma);
-                image_data[y * bytes_per_scanline + x * 2 + 0] = val >> 8;
-                image_data[y * bytes_per_scanline + x * 2 + 1] = val;
-            }
-            else
-            {
-                
-                uint8_t val = image_data[y * bytes_per_scanline + x];
-                val = apply_gamma_u8(val, gamma);
-                image_data[y * bytes_per_scanline + x] = val;
-            }
+            uint8_t * sample = &row[(x * components + c) * 2];
+            uint16_t val = ((uint16_t)sample[0] << 8) | sample[1];
+            val = table ? table[val] : apply_gamma_u16(val, gamma);
+            sample[0] = val >> 8;
+            sample[1] = val;
         }
     }
 }
 
-static void defilter(uint8_t * image_data, size_t data_size, byte_buffer * dec, uint32_t width, uint32_t height, uint8_t interlace_layer, uint8_t bit_depth, uint8_t components, uint8_t * error)
+// `table_16` is room for a 65536-entry table for 16-bit images; if it's null, every sample is computed on its own
+static void apply_gamma(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, float gamma, uint16_t * table_16)
 {
-    #define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { *error = (ERRVAL); return; } }
-    
-    // interlace_layer:
-    // 0: not interlaced
-    // 1~7: adam7 interlace layers
-    //  1 6 4 6 2 6 4 6
-    //  7 7 7 7 7 7 7 7
-    //  5 6 5 6 5 6 5 6
-    //  7 7 7 7 7 7 7 7
-    //  3 6 4 6 3 6 4 6
-    //  7 7 7 7 7 7 7 7
-    //  5 6 5 6 5 6 5 6
-    //  7 7 7 7 7 7 7 7
-    
-    uint8_t y_inits[] = {0, 0, 0, 4, 0, 2, 0, 1};
-    uint8_t y_gaps[] = {1, 8, 8, 8, 4, 4, 2, 2};
-    uint8_t x_inits[] = {0, 0, 4, 0, 2, 0, 1, 0};
-    uint8_t x_gaps[] = {1, 8, 8, 4, 4, 2, 2, 1};
-    
-    size_t y_init = y_inits[interlace_layer];
-    size_t y_gap = y_gaps[interlace_layer];
-    size_t x_init = x_inits[interlace_layer];
-    size_t x_gap = x_gaps[interlace_layer];
-    
-    // note: bit_depth can only be less than 8 if there is only one component
-    
-    size_t bytes_per_scanline = (((size_t)width - x_init + x_gap - 1) / x_gap * bit_depth + 7) / 8 * components;
-    //printf("%d %d %d %lld\n", width, bit_depth, components, bytes_per_scanline);
-    size_t min_bytes = (bit_depth + 7) / 8;
-    size_t output_bps = min_bytes * components * width;
-    //printf("%lld %d %d %d\n", dec->len, output_bps, output_bps * (height - y_init + y_gap - 1) / y_gap, height);
-    
-    //printf("!!! %lld %d %d %lld %lld\n", height, interlace_layer, bytes_per_scanline, min_bytes, output_bps);
-    
-    uint8_t * y_prev = (uint8_t *)malloc(bytes_per_scanline);
-    uint8_t * y_prev_next = (uint8_t *)malloc(bytes_per_scanline);
-    WPNG_ASSERT(y_prev, 100);
-    WPNG_ASSERT(y_prev_next, 100);
-    memset(y_prev, 0, bytes_per_scanline);
-    memset(y_prev_next, 0, bytes_per_scanline);
-    
-    //printf("%d\n", min_bytes * components);
+    uint8_t components = bpp;
+    if (is_16bit)
+        components /= 2;
     
-    size_t scanline_count = ((size_t)height - y_init + y_gap - 1) / y_gap;
-    //printf("%lld %lld %lld\n", scanline_count, scanline_count * (bytes_per_scanline + 1), dec->len);
-    if(scanline_count * (bytes_per_scanline + 1) > dec->len)
+    if (is_16bit)
     {
-        *error = 2;
+        if (table_16)
+        {
+            for (uint32_t val = 0; val < 65536; val += 1)
+                table_16[val] = apply_gamma_u16(val, gamma);
+        }
+        for (size_t y = 0; y < height; y += 1)
+            apply_gamma_row_u16(&image_data[y * bytes_per_scanline], width, table_16, components, gamma);
         return;
     }
     
-    for (size_t y = y_init; bytes_per_scanline > 0 && y < height; y += y_gap)
+    const uint8_t * table = get_gamma_table_u8(gamma);
+    for (size_t y = 0; y < height; y += 1)
     {
-        // double buffered y_prev
-        uint8_t * temp = y_prev;
-        y_prev = y_prev_next;
-        y_prev_next = temp;
-        
-        uint8_t filter_type = byte_pop(dec);
-        //puts("--");
-        //printf("%lld %lld\n", dec->cur + bytes_per_scanline, dec->len);
-        //printf("%lld %d %d %lld\n", y, height, interlace_layer, bytes_per_scanline);
-        WPNG_ASSERT(dec->cur + bytes_per_scanline <= dec->len, 1);
-        
-        //printf("at y %d ", y);
-        //if (filter_type == 0)
-        //    puts("filter mode 0");
-        //if (filter_type == 1)
-        //    puts("filter mode 1");
-        //if (filter_type == 2)
-        //    puts("filter mode 2");
-        //if (filter_type == 3)
-        //    puts("filter mode 3");
-        //if (filter_type == 4)
-        //    puts("filter mode 4");
-        
-        for (size_t x = 0; x < bytes_per_scanline; x += 1)
+        uint8_t * row = &image_data[y * bytes_per_scanline];
+        switch (components)
         {
-            uint8_t byte = byte_pop(dec);
-            int16_t left = x >= min_bytes * components ? y_prev_next[x - min_bytes * components] : 0;
-            int16_t up   = y_prev[x];
-            int16_t upleft = x >= min_bytes * components ? y_prev[x - min_bytes * components] : 0;
-            
-            if (filter_type == 1)
-                byte += left;
-            if (filter_type == 2)
-                byte += up;
-            if (filter_type == 3)
-                byte += (up + left) / 2;
-            if (filter_type == 4)
-                byte += paeth_get_ref_raw(left, up, upleft);
-            
-            // note: bits_per_pixel can only be less than 8 if there is only one component
-            if (bit_depth < 8)
-            {
-                size_t start = y * output_bps;
-                size_t x_out = (x_gap * x) * 8 / bit_depth + x_init;
-                for (size_t i = 0; i < 8 / bit_depth; i++)
-                {
-                    if (i * x_gap + x_out >= width)
-                    {
-                        //printf("breaking at %d\n", i);
-                        break;
-                    }
-                    uint8_t val = byte >> (8 - (bit_depth * (i + 1)));
-                    val &= (1 << bit_depth) - 1;
-                    //if (interlace_layer == 6)
-                    //    printf("asdf %d %d\n", start + x_out + x_gap * i, val);
-                    assert(start + x_out + x_gap * i < data_size);
-                    image_data[start + x_out + x_gap * i] = val;
-                }
-            }
-            else
-            {
-                size_t true_x = x / (min_bytes * components) * min_bytes * components;
-                size_t leftover_x = x - true_x;
-                size_t x_out = true_x * x_gap + leftover_x + x_init * min_bytes * components;
-                assert(y * output_bps + x_out < data_size);
-                image_data[y * output_bps + x_out] = byte;
-            }
-            
-            y_prev_next[x] = byte;
+        case 1: apply_gamma_row_u8(row, width, table, 1); break;
+        case 2: apply_gamma_row_u8(row, width, table, 2); break;
+        case 3: apply_gamma_row_u8(row, width, table, 3); break;
+        default: apply_gamma_row_u8(row, width, table, 4); break;
         }
     }
-    
-    free(y_prev);
-    free(y_prev_next);
-    
-    #undef WPNG_ASSERT
 }
 
-enum {
-    WPNG_READ_SKIP_CRC = 1, // don't check chunk CRCs 
-    WPNG_READ_SKIP_CRITICAL_CHUNKS = 2, // skip unknown critical chunks
-    WPNG_READ_SKIP_GAMMA_CORRECTION = 4, // don't apply gamma correction
-    WPNG_READ_SKIP_IDAT_CRC = 8, // like chrome
-    WPNG_READ_ERROR_ON_BAD_ANCILLARY_CRC = 16, // treat chunks with bad CRCs like unknown chunks
-    WPNG_READ_SKIP_ADLER32 = 32, // don't check zlib checksums
-    WPNG_READ_FORCE_8BIT = 256, // convert 16-bit images to 8-bit on load
-};
-
-// output:
-
-typedef struct {
-    uint8_t * data;               // u8 array
-    size_t size;                  // size of array
-    size_t bytes_per_scanline;    // width
-    uint32_t width;               // height
-    uint32_t height;              // bytes per pixel
-    float gamma;                  // is 16 bit or not (decoder output)
-    uint8_t bytes_per_pixel;      // was originally 16 bit or not (original png file)
-    uint8_t is_16bit;             // png file specified that it was srgb or not
-    uint8_t was_16bit;            // scanline byte count
-    uint8_t was_srgb;             // gamma (-1 if unset or srgb)
-    uint8_t error;                
-} wpng_load_output;
-// NOTE: the decoder ALWAYS output srgb data, even if was_srgb is unset!
-
 static inline uint8_t u16_to_u8(uint16_t val)
 {
     //return round((double)val / 257.0); // seems to be what libpng does
@@ -247,125 +181,1266 @@ static inline uint8_t u16_to_u8(uint16_t val)
     return val;
 }
 
-// on error, writes nonzero to the "error" value of output and leaves the rest untouched
-// on success, writes zero to the "error" value of output and writes every other value
-static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+// the defilter kernels are written against a constant bpp and get inlined once per pixel size by defilter(), so the compiler can unroll them
+// paeth has a data dependency from each pixel to the next, so its SSE2 version works on a whole pixel at once instead of on several pixels
+
+static inline void defilter_sub(uint8_t * row, size_t bytes_per_scanline, const uint8_t bpp)
 {
-    assert(output);
-    assert(buf);
-    assert(buf->data);
-    
-    #define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { output->error = (ERRVAL); return; } }
-    // 1 - chunk size error
-    // 2 - buffer overflow
-    // 3 - invalid chunk name
-    // 4 - failed crc
-    // 5 - chunk syntax error or invalid value within chunk
-    // 6 - chunk ordering error
-    // 7 - unknown critical chunk
-    // 8 - missing mandatory chunk (IHDR/IDAT/IEND)
-    // 9 - has chunk that's forbidden for given color format
-    // 10 - missing contextual mandatory chunk (PLTE on indexed images)
-    // 11 - invalid zlib data
-    // 100 - allocation failure
-    // 255 - not a png file
-    
-	if (buf->len < 8 || memcmp(buf->data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
+    for (size_t x = bpp; x < bytes_per_scanline; x += 1)
+        row[x] += row[x - bpp];
+}
+
+static inline void defilter_up(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline)
+{
+    size_t x = 0;
+#ifdef WPNG_SSE2
+    for (; x + 16 <= bytes_per_scanline; x += 16)
     {
-        output->error = 255;
-		return;
+        __m128i a = _mm_loadu_si128((const __m128i *)&row[x]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&prev_row[x]);
+        _mm_storeu_si128((__m128i *)&row[x], _mm_add_epi8(a, b));
     }
-    buf->cur = 8;
-    
-    byte_buffer idat;
-    memset(&idat, 0, sizeof(byte_buffer));
-    
-    uint32_t width = 0;
-    uint32_t height = 0;
-    uint8_t bit_depth = 0;
-    uint8_t color_type = 0;
-    uint8_t interlacing = 0;
-    
-    uint8_t palette[1024] = {0};
-    uint16_t palette_size = 0;
-    uint8_t has_idat = 0;
-    uint8_t has_iend = 0;
-    
-    uint8_t has_trns = 0;
-    uint8_t has_chrm = 0;
-    uint8_t has_gama = 0;
-    uint8_t has_iccp = 0;
-    uint8_t has_sbit = 0;
-    uint8_t has_bkgd = 0;
-    uint8_t has_hist = 0;
-    uint8_t has_phys = 0;
-    uint8_t has_time = 0;
-    
-    uint32_t transparent_r = 0xFFFFFFFF;
-    uint32_t transparent_g = 0xFFFFFFFF;
-    uint32_t transparent_b = 0xFFFFFFFF;
-    
-    uint64_t chunk_count = 0;
-    
-    uint8_t is_srgb = 0;
-    float gamma = -1.0;
-    
-    uint8_t prev_was_idat = 0; // multiple idat chunks must be consecutive
-    while (buf->cur < buf->len)
+#endif
+    for (; x < bytes_per_scanline; x += 1)
+        row[x] += prev_row[x];
+}
+
+static inline void defilter_avg(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, const uint8_t bpp)
+{
+    for (size_t x = 0; x < bpp && x < bytes_per_scanline; x += 1)
+        row[x] += prev_row[x] >> 1;
+    for (size_t x = bpp; x < bytes_per_scanline; x += 1)
+        row[x] += (prev_row[x] + row[x - bpp]) >> 1;
+}
+
+// same result as paeth_get_ref_raw
+static inline uint8_t paeth_predict(int left, int up, int upleft)
+{
+    int diff_left = abs(up - upleft);
+    int diff_up = abs(left - upleft);
+    int diff_upleft = abs(left + up - upleft * 2);
+    if (diff_left <= diff_up && diff_left <= diff_upleft)
+        return left;
+    return diff_up <= diff_upleft ? up : upleft;
+}
+
+#ifdef WPNG_SSE2
+static inline __m128i defilter_load_pixel(const uint8_t * p, const uint8_t bpp)
+{
+    uint64_t val = 0;
+    memcpy(&val, p, bpp);
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&val), _mm_setzero_si128());
+}
+
+static inline __m128i defilter_abs16(__m128i x)
+{
+#ifdef WPNG_SSSE3
+    return _mm_abs_epi16(x);
+#else
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+#endif
+}
+
+// one pixel per iteration, one sample per 16-bit lane
+// returns how many bytes it defiltered (all the whole pixels)
+static inline size_t defilter_paeth_sse2(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, const uint8_t bpp)
+{
+    __m128i left = _mm_setzero_si128();
+    __m128i upleft = _mm_setzero_si128();
+    size_t x = 0;
+    for (; x + bpp <= bytes_per_scanline; x += bpp)
     {
-        chunk_count += 1;
+        __m128i up = defilter_load_pixel(&prev_row[x], bpp);
+        __m128i val = defilter_load_pixel(&row[x], bpp);
         
-        uint32_t size = byteswap_int(bytes_pop_int(buf, 4), 4);
-        WPNG_ASSERT(size < 0x80000000, 1); // must be 31 bit
-        WPNG_ASSERT(buf->cur + size + 8 <= buf->len, 2); // must not overflow buffer
+        __m128i diff_left = _mm_sub_epi16(up, upleft);
+        __m128i diff_up = _mm_sub_epi16(left, upleft);
+        __m128i diff_upleft = defilter_abs16(_mm_add_epi16(diff_left, diff_up));
+        diff_left = defilter_abs16(diff_left);
+        diff_up = defilter_abs16(diff_up);
         
-        size_t chunk_start = buf->cur;
-        char name[5] = {0};
-        for (size_t i = 0; i < 4; i += 1)
-        {
-            name[i] = byte_pop(buf);
-            uint8_t upcased = name[i] | 0x20;
-            WPNG_ASSERT(upcased >= 97 && upcased <= 122, 3);
-        }
-        uint8_t critical = !(name[0] & 0x20);
+        // ties go to left, then up, like paeth_predict
+        __m128i smallest = _mm_min_epi16(diff_upleft, _mm_min_epi16(diff_left, diff_up));
+        __m128i is_left = _mm_cmpeq_epi16(smallest, diff_left);
+        __m128i is_up = _mm_cmpeq_epi16(smallest, diff_up);
+        __m128i ref = _mm_or_si128(_mm_and_si128(is_up, up), _mm_andnot_si128(is_up, upleft));
+        ref = _mm_or_si128(_mm_and_si128(is_left, left), _mm_andnot_si128(is_left, ref));
         
-        size_t cur_start = buf->cur;
+        left = _mm_and_si128(_mm_add_epi16(val, ref), _mm_set1_epi16(0xFF));
+        upleft = up;
         
-        uint8_t checksum_failed = 0;
-        if (!(flags & WPNG_READ_SKIP_CRC) && !((flags & WPNG_READ_SKIP_IDAT_CRC) && memcmp(name, "IDAT", 4) == 0))
+        uint64_t out;
+        _mm_storel_epi64((__m128i *)&out, _mm_packus_epi16(left, left));
+        memcpy(&row[x], &out, bpp);
+    }
+    return x;
+}
+#endif
+
+static inline void defilter_paeth(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, const uint8_t bpp)
+{
+    size_t x = 0;
+#ifdef WPNG_SSE2
+    if (bpp >= 3)
+        x = defilter_paeth_sse2(row, prev_row, bytes_per_scanline, bpp);
+#endif
+    for (; x < bpp && x < bytes_per_scanline; x += 1)
+        row[x] += prev_row[x];
+    for (; x < bytes_per_scanline; x += 1)
+        row[x] += paeth_predict(row[x - bpp], prev_row[x], prev_row[x - bpp]);
+}
+
+static inline void defilter_bpp(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, uint8_t filter_type, const uint8_t bpp)
+{
+    if (filter_type == 1)
+        defilter_sub(row, bytes_per_scanline, bpp);
+    else if (filter_type == 3)
+        defilter_avg(row, prev_row, bytes_per_scanline, bpp);
+    else if (filter_type == 4)
+        defilter_paeth(row, prev_row, bytes_per_scanline, bpp);
+}
+
+// undoes the filter of one scanline, in place
+// `prev_row` is the previous scanline of the same image or adam7 pass after defiltering, or all zeroes for the first one
+// bpp is the number of bytes per pixel, rounded up to 1
+static void defilter(uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, uint8_t filter_type, uint8_t bpp)
+{
+    if (filter_type == 2)
+    {
+        defilter_up(row, prev_row, bytes_per_scanline);
+        return;
+    }
+    switch (bpp)
+    {
+    case 1: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 1); break;
+    case 2: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 2); break;
+    case 3: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 3); break;
+    case 4: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 4); break;
+    case 6: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 6); break;
+    case 8: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, 8); break;
+    default: defilter_bpp(row, prev_row, bytes_per_scanline, filter_type, bpp); break;
+    }
+}
+
+// output pixel formats, picked with WPNG_READ_FORMAT(...) in the flags
+// WPNG_FORMAT_PNG (the default) is the png's own layout: Y, YA, RGB or RGBA (with alpha if there's a tRNS chunk), with 8-bit or big endian 16-bit samples
+// the others have the same layout whatever the png has: formats without alpha drop it, and GRAY8 is the luma of color images
+enum {
+    WPNG_FORMAT_PNG = 0,
+    WPNG_FORMAT_RGBA8,
+    WPNG_FORMAT_BGRA8,
+    WPNG_FORMAT_RGB8,
+    WPNG_FORMAT_RGBA8_PREMULTIPLIED, // color multiplied by alpha (after gamma correction)
+    WPNG_FORMAT_BGRA8_PREMULTIPLIED,
+    WPNG_FORMAT_GRAY8,
+    WPNG_FORMAT_RGBA16, // native endian uint16_t samples
+    WPNG_FORMAT_RGBA32F, // native endian float samples from 0 to 1, with linear light color (no sRGB transfer function) and straight alpha
+    // indexed images and gray images of up to 8 bits only: the samples themselves, with the colors they stand for in the output's palette
+    WPNG_FORMAT_INDEX8, // one byte per pixel
+    WPNG_FORMAT_INDEX_PACKED, // rows as the png stores them, with 1, 2, 4 or 8 bits per pixel (leftmost pixel in the highest bits); whole rows only, at full size
+    WPNG_FORMAT_COUNT,
+};
+
+// (0 for INDEX_PACKED, whose pixels can be smaller than a byte)
+static const uint8_t wpng_format_bpp[WPNG_FORMAT_COUNT] = {0, 4, 4, 3, 4, 4, 1, 8, 16, 1, 0};
+
+#define WPNG_READ_FORMAT(pixel_format) ((uint32_t)(pixel_format) << 12)
+
+static inline uint8_t wpng_read_format(uint32_t flags)
+{
+    return (flags >> 12) & 0xF;
+}
+
+// everything needed to convert scanlines from the png's pixel format to the output format
+typedef struct {
+    uint8_t color_type;
+    uint8_t bit_depth;
+    uint8_t components;
+    uint8_t bpp; // bytes per pixel in the png, if it's at least 8 bits per sample
+    uint8_t out_bpp;
+    uint8_t has_trns;
+    uint8_t force_8bit;
+    uint8_t needs_conversion;
+    uint8_t is_raw; // the output rows are the defiltered scanlines as they are
+    uint32_t transparent_r;
+    uint32_t transparent_g;
+    uint32_t transparent_b;
+    const uint8_t * palette; // rgba; gray images of up to 8 bits get one too, with the expanded gray value and tRNS alpha
+    // pixel formats other than WPNG_FORMAT_PNG are converted to from the png's layout (out_bpp bytes per pixel) a row at a time, gamma correction included
+    uint8_t pixel_format;
+    double gamma; // negative if there's no gamma correction to do
+    uint8_t gamma_u8[256]; // 8-bit gamma table, or the identity
+    const uint16_t * gamma_u16; // 16-bit gamma table; if null, samples are computed on their own
+    float linear_u8[256]; // RGBA32F only: linear value of each 8-bit sample
+    const float * linear_u16; // RGBA32F only: linear value of each 16-bit sample; if null, samples are computed on their own
+    const uint8_t * format_palette; // for the 8-bit pixel formats: the palette (see above) converted to the pixel format, or null if there's no palette; for INDEX8, the identity
+    uint8_t format_palette_data[256 * 4];
+} wpng_row_format;
+
+// indexed or gray pixels of up to 8 bits, looked up in palette (format->palette, or format->format_palette)
+static inline void convert_row_lookup(const uint8_t * row, size_t first, size_t count, uint8_t * out, size_t out_step, const uint8_t * palette, const uint8_t out_bpp, const uint8_t bit_depth)
+{
+    // (with the bit depth known up front, each sample is a shift and a mask away)
+    const uint8_t per_byte = 8 / bit_depth;
+    const uint8_t mask = (1 << bit_depth) - 1;
+    for (size_t x = first; x < first + count; x += 1)
+    {
+        uint8_t val = bit_depth == 8 ? row[x] : (row[x / per_byte] >> ((per_byte - 1 - x % per_byte) * bit_depth)) & mask;
+        memcpy(out, &palette[val * 4], out_bpp);
+        out += out_step;
+    }
+}
+
+// convert_row_lookup specialised for the number of output bytes per pixel and the png's bit depth
+static void convert_row_lookup_from(const uint8_t * row, size_t first, size_t count, uint8_t * out, size_t out_step, const uint8_t * palette, uint8_t out_bpp, uint8_t bit_depth)
+{
+    switch (bit_depth)
+    {
+    case 1:
+        switch (out_bpp)
         {
-            buf->cur = cur_start + size;
-            uint32_t expected_checksum = byteswap_int(bytes_pop_int(buf, 4), 4);
-            uint32_t checksum = infl_compute_crc32(&buf->data[chunk_start], size + 4, 0);
-            checksum_failed = (checksum != expected_checksum);
+        case 1: convert_row_lookup(row, first, count, out, out_step, palette, 1, 1); break;
+        case 2: convert_row_lookup(row, first, count, out, out_step, palette, 2, 1); break;
+        case 3: convert_row_lookup(row, first, count, out, out_step, palette, 3, 1); break;
+        default: convert_row_lookup(row, first, count, out, out_step, palette, 4, 1); break;
         }
-        
-        // always check CRC for critical chunks
-        if (critical)
-            WPNG_ASSERT(!checksum_failed, 4);
-        // skip ancillary chunks with bad checksums, unless the option is set to error instead
-        if (checksum_failed)
+        break;
+    case 2:
+        switch (out_bpp)
         {
-            if (flags & WPNG_READ_ERROR_ON_BAD_ANCILLARY_CRC)
-                WPNG_ASSERT(!checksum_failed, 4)
-            else
-            {
-                buf->cur = cur_start + size + 4;
-                continue;
-            }
+        case 1: convert_row_lookup(row, first, count, out, out_step, palette, 1, 2); break;
+        case 2: convert_row_lookup(row, first, count, out, out_step, palette, 2, 2); break;
+        case 3: convert_row_lookup(row, first, count, out, out_step, palette, 3, 2); break;
+        default: convert_row_lookup(row, first, count, out, out_step, palette, 4, 2); break;
         }
-        
-        buf->cur = cur_start;
-        
-        if (memcmp(name, "IHDR", 4) == 0)
+        break;
+    case 4:
+        switch (out_bpp)
         {
-            WPNG_ASSERT(size == 13, 5);
-            WPNG_ASSERT(chunk_count == 1, 6); // must be first
-            WPNG_ASSERT(width == 0 && height == 0, 6); // must not have multiple
-            
-            width = byteswap_int(bytes_pop_int(buf, 4), 4);
-            height = byteswap_int(bytes_pop_int(buf, 4), 4);
-            WPNG_ASSERT(width != 0 && height != 0, 5); // must be coherent
+        case 1: convert_row_lookup(row, first, count, out, out_step, palette, 1, 4); break;
+        case 2: convert_row_lookup(row, first, count, out, out_step, palette, 2, 4); break;
+        case 3: convert_row_lookup(row, first, count, out, out_step, palette, 3, 4); break;
+        default: convert_row_lookup(row, first, count, out, out_step, palette, 4, 4); break;
+        }
+        break;
+    default:
+        switch (out_bpp)
+        {
+        case 1: convert_row_lookup(row, first, count, out, out_step, palette, 1, 8); break;
+        case 2: convert_row_lookup(row, first, count, out, out_step, palette, 2, 8); break;
+        case 3: convert_row_lookup(row, first, count, out, out_step, palette, 3, 8); break;
+        default: convert_row_lookup(row, first, count, out, out_step, palette, 4, 8); break;
+        }
+        break;
+    }
+}
+
+// converts `count` big endian 16-bit samples to 8-bit ones, rounding the same way as u16_to_u8
+static void convert_samples_16_to_8(const uint8_t * in, size_t count, uint8_t * out)
+{
+    size_t i = 0;
+#ifdef WPNG_SSE2
+    // (val * 255 + 32895) >> 16 is exactly u16_to_u8(val); the 32-bit product is split into 16-bit halves
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i val = _mm_loadu_si128((const __m128i *)&in[i * 2]);
+        val = _mm_or_si128(_mm_slli_epi16(val, 8), _mm_srli_epi16(val, 8));
+        __m128i lo = _mm_mullo_epi16(val, _mm_set1_epi16(255));
+        __m128i hi = _mm_mulhi_epu16(val, _mm_set1_epi16(255));
+        // lo + 32895 carries into hi if lo > 32640 (compared as unsigned)
+        __m128i carry = _mm_cmpgt_epi16(_mm_xor_si128(lo, _mm_set1_epi16((short)0x8000)), _mm_set1_epi16(32640 - 0x8000));
+        hi = _mm_sub_epi16(hi, carry);
+        _mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(hi, hi));
+    }
+#endif
+    for (; i < count; i += 1)
+        out[i] = u16_to_u8(((uint16_t)in[i * 2] << 8) | in[i * 2 + 1]);
+}
+
+// copies `count` pixels of `bpp` bytes each, writing each one `out_step` bytes after the previous one (e.g. to every x_gap'th pixel, for adam7 passes)
+static inline void scatter_pixels(const uint8_t * row, size_t count, uint8_t * out, size_t out_step, const uint8_t bpp)
+{
+    for (size_t x = 0; x < count; x += 1)
+    {
+        memcpy(out, &row[x * bpp], bpp);
+        out += out_step;
+    }
+}
+
+static void scatter_pixels_from(const uint8_t * row, size_t count, uint8_t * out, size_t out_step, uint8_t bpp)
+{
+    switch (bpp)
+    {
+    case 1: scatter_pixels(row, count, out, out_step, 1); break;
+    case 2: scatter_pixels(row, count, out, out_step, 2); break;
+    case 3: scatter_pixels(row, count, out, out_step, 3); break;
+    case 4: scatter_pixels(row, count, out, out_step, 4); break;
+    case 6: scatter_pixels(row, count, out, out_step, 6); break;
+    default: scatter_pixels(row, count, out, out_step, 8); break;
+    }
+}
+
+// like convert_samples_16_to_8, for `count` pixels of `components` samples each, writing each pixel `out_step` bytes after the previous one
+static inline void scatter_samples_16_to_8(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const uint8_t components)
+{
+    for (size_t x = 0; x < count; x += 1)
+    {
+        for (uint8_t c = 0; c < components; c += 1)
+            out[c] = u16_to_u8(((uint16_t)in[c * 2] << 8) | in[c * 2 + 1]);
+        in += components * 2;
+        out += out_step;
+    }
+}
+
+static void scatter_samples_16_to_8_from(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, uint8_t components)
+{
+    switch (components)
+    {
+    case 1: scatter_samples_16_to_8(in, count, out, out_step, 1); break;
+    case 2: scatter_samples_16_to_8(in, count, out, out_step, 2); break;
+    case 3: scatter_samples_16_to_8(in, count, out, out_step, 3); break;
+    default: scatter_samples_16_to_8(in, count, out, out_step, 4); break;
+    }
+}
+
+static inline uint8_t convert_uses_palette(const wpng_row_format * format)
+{
+    return format->color_type == 3 || (format->components == 1 && format->bit_depth <= 8 && format->needs_conversion);
+}
+
+// converts `count` pixels of a defiltered scanline, starting from pixel `first`, to Y/YA/RGB/RGBA, writing each pixel `out_step` bytes after the previous one
+static void convert_row_native(const uint8_t * row, size_t first, size_t count, uint8_t * out, size_t out_step, const wpng_row_format * format)
+{
+    uint8_t bit_depth = format->bit_depth;
+    uint8_t out_bpp = format->out_bpp;
+    uint8_t has_trns = format->has_trns;
+    
+    if (convert_uses_palette(format))
+    {
+        convert_row_lookup_from(row, first, count, out, out_step, format->palette, out_bpp, bit_depth);
+        return;
+    }
+    
+    // everything else has whole bytes per pixel
+    row += first * format->bpp;
+    
+    if (!format->needs_conversion)
+    {
+        if (out_step == format->bpp)
+            memcpy(out, row, count * format->bpp);
+        else
+            scatter_pixels_from(row, count, out, out_step, format->bpp);
+        return;
+    }
+    
+    if (bit_depth == 16 && format->force_8bit && !has_trns)
+    {
+        if (out_step == out_bpp)
+            convert_samples_16_to_8(row, count * out_bpp, out);
+        else
+            scatter_samples_16_to_8_from(row, count, out, out_step, out_bpp);
+        return;
+    }
+    
+    for (size_t x = 0; x < count; x += 1)
+    {
+        uint8_t * px = &out[x * out_step];
+        if (format->components == 1)
+        {
+            uint16_t val = ((uint16_t)row[x * 2] << 8) | row[x * 2 + 1];
+            
+            if (format->force_8bit)
+            {
+                px[0] = u16_to_u8(val);
+                if (has_trns)
+                    px[1] = val == format->transparent_r ? 0 : 0xFF;
+            }
+            else
+            {
+                px[0] = val >> 8;
+                px[1] = val & 0xFF;
+                if (has_trns)
+                {
+                    px[2] = val == format->transparent_r ? 0 : 0xFF;
+                    px[3] = val == format->transparent_r ? 0 : 0xFF;
+                }
+            }
+        }
+        else if (format->components == 3)
+        {
+            if (bit_depth == 16)
+            {
+                uint16_t val_r = ((uint16_t)row[x * 6 + 0] << 8) | row[x * 6 + 1];
+                uint16_t val_g = ((uint16_t)row[x * 6 + 2] << 8) | row[x * 6 + 3];
+                uint16_t val_b = ((uint16_t)row[x * 6 + 4] << 8) | row[x * 6 + 5];
+                
+                uint8_t is_transparent = (val_r == format->transparent_r && val_g == format->transparent_g && val_b == format->transparent_b);
+                
+                if (format->force_8bit)
+                {
+                    px[0] = u16_to_u8(val_r);
+                    px[1] = u16_to_u8(val_g);
+                    px[2] = u16_to_u8(val_b);
+                    if (has_trns)
+                        px[3] = is_transparent ? 0 : 0xFF;
+                }
+                else
+                {
+                    px[0] = val_r >> 8;
+                    px[1] = val_r & 0xFF;
+                    px[2] = val_g >> 8;
+                    px[3] = val_g & 0xFF;
+                    px[4] = val_b >> 8;
+                    px[5] = val_b & 0xFF;
+                    if (has_trns)
+                    {
+                        px[6] = is_transparent ? 0 : 0xFF;
+                        px[7] = is_transparent ? 0 : 0xFF;
+                    }
+                }
+            }
+            else
+            {
+                uint8_t val_r = row[x * 3 + 0];
+                uint8_t val_g = row[x * 3 + 1];
+                uint8_t val_b = row[x * 3 + 2];
+                
+                uint8_t is_transparent = (val_r == format->transparent_r && val_g == format->transparent_g && val_b == format->transparent_b);
+                
+                px[0] = val_r;
+                px[1] = val_g;
+                px[2] = val_b;
+                if (has_trns)
+                    px[3] = is_transparent ? 0 : 0xFF;
+            }
+        }
+    }
+}
+
+// writes `count` samples of a defiltered adam7 pass scanline into pixels x_init, x_init + x_gap, ... of an output row with the same bit depth
+// the samples that land in the same output byte are put together first, so that each byte is only read and written once
+static inline void scatter_packed_samples(const uint8_t * row, size_t count, uint8_t * out, size_t x_init, size_t x_gap, const uint8_t bit_depth)
+{
+    const uint8_t per_byte = 8 / bit_depth;
+    const uint8_t mask = (1 << bit_depth) - 1;
+    size_t x = x_init;
+    for (size_t i = 0; i < count; )
+    {
+        size_t byte = x / per_byte;
+        uint8_t bits = 0;
+        uint8_t bits_mask = 0;
+        for (; i < count && x / per_byte == byte; i += 1, x += x_gap)
+        {
+            uint8_t val = (row[i / per_byte] >> ((per_byte - 1 - i % per_byte) * bit_depth)) & mask;
+            uint8_t shift = (per_byte - 1 - x % per_byte) * bit_depth;
+            bits |= val << shift;
+            bits_mask |= mask << shift;
+        }
+        out[byte] = (out[byte] & ~bits_mask) | bits;
+    }
+}
+
+static void scatter_packed_row(const uint8_t * row, size_t count, uint8_t * out, size_t x_init, size_t x_gap, uint8_t bit_depth)
+{
+    // rows that aren't spread out (pass 7) are copied a whole byte at a time, apart from the last one, whose padding bits are left alone
+    if (x_init == 0 && x_gap == 1)
+    {
+        size_t whole = count * bit_depth / 8;
+        memcpy(out, row, whole);
+        row += whole;
+        out += whole;
+        count -= whole * 8 / bit_depth;
+    }
+    switch (bit_depth)
+    {
+    case 1: scatter_packed_samples(row, count, out, x_init, x_gap, 1); break;
+    case 2: scatter_packed_samples(row, count, out, x_init, x_gap, 2); break;
+    case 4: scatter_packed_samples(row, count, out, x_init, x_gap, 4); break;
+    default: scatter_packed_samples(row, count, out, x_init, x_gap, 8); break;
+    }
+}
+
+static inline uint8_t premultiply_u8(uint8_t val, uint8_t alpha)
+{
+    // val * alpha / 255, rounded
+    uint32_t x = (uint32_t)val * alpha + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// 8-bit Y/YA/RGB/RGBA pixels to one of the 8-bit pixel formats
+static inline void format_pixels_u8(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const uint8_t * gamma, const uint8_t components, const uint8_t pixel_format)
+{
+    const uint8_t is_premultiplied = pixel_format == WPNG_FORMAT_RGBA8_PREMULTIPLIED || pixel_format == WPNG_FORMAT_BGRA8_PREMULTIPLIED;
+    for (size_t x = 0; x < count; x += 1)
+    {
+        const uint8_t * px = &in[x * components];
+        uint8_t * o = &out[x * out_step];
+        uint8_t r = gamma[px[0]];
+        uint8_t g = components >= 3 ? gamma[px[1]] : r;
+        uint8_t b = components >= 3 ? gamma[px[2]] : r;
+        uint8_t a = (components == 2 || components == 4) ? px[components - 1] : 0xFF;
+        if (is_premultiplied)
+        {
+            r = premultiply_u8(r, a);
+            g = premultiply_u8(g, a);
+            b = premultiply_u8(b, a);
+        }
+        switch (pixel_format)
+        {
+        case WPNG_FORMAT_GRAY8:
+            // rec. 709 luma weights, out of 256
+            o[0] = components >= 3 ? ((uint32_t)r * 54 + (uint32_t)g * 183 + (uint32_t)b * 19 + 128) >> 8 : r;
+            break;
+        case WPNG_FORMAT_RGB8:
+            o[0] = r;
+            o[1] = g;
+            o[2] = b;
+            break;
+        case WPNG_FORMAT_BGRA8:
+        case WPNG_FORMAT_BGRA8_PREMULTIPLIED:
+            o[0] = b;
+            o[1] = g;
+            o[2] = r;
+            o[3] = a;
+            break;
+        default:
+            o[0] = r;
+            o[1] = g;
+            o[2] = b;
+            o[3] = a;
+            break;
+        }
+    }
+}
+
+static inline void format_pixels_u8_from(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const uint8_t * gamma, const uint8_t components, uint8_t pixel_format)
+{
+    switch (pixel_format)
+    {
+    case WPNG_FORMAT_BGRA8: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_BGRA8); break;
+    case WPNG_FORMAT_RGB8: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_RGB8); break;
+    case WPNG_FORMAT_RGBA8_PREMULTIPLIED: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_RGBA8_PREMULTIPLIED); break;
+    case WPNG_FORMAT_BGRA8_PREMULTIPLIED: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_BGRA8_PREMULTIPLIED); break;
+    case WPNG_FORMAT_GRAY8: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_GRAY8); break;
+    default: format_pixels_u8(in, count, out, out_step, gamma, components, WPNG_FORMAT_RGBA8); break;
+    }
+}
+
+static inline uint16_t format_gamma_u16(const wpng_row_format * format, uint16_t val)
+{
+    if (format->gamma_u16)
+        return format->gamma_u16[val];
+    return format->gamma >= 0.0 ? apply_gamma_u16(val, format->gamma) : val;
+}
+
+static inline float format_linear_u16(const wpng_row_format * format, uint16_t val)
+{
+    if (format->linear_u16)
+        return format->linear_u16[val];
+    return to_linear(val / 65535.0, format->gamma);
+}
+
+// Y/YA/RGB/RGBA pixels with 8-bit or big endian 16-bit samples to RGBA16 or RGBA32F
+static inline void format_pixels_wide(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const wpng_row_format * format, const uint8_t components, const uint8_t is_16bit, const uint8_t is_float)
+{
+    const uint8_t has_alpha = components == 2 || components == 4;
+    for (size_t x = 0; x < count; x += 1)
+    {
+        uint16_t samples[4];
+        for (uint8_t c = 0; c < components; c += 1)
+        {
+            const uint8_t * sample = &in[(x * components + c) * (is_16bit ? 2 : 1)];
+            samples[c] = is_16bit ? ((uint16_t)sample[0] << 8) | sample[1] : sample[0];
+        }
+        uint16_t alpha = has_alpha ? samples[components - 1] : is_16bit ? 0xFFFF : 0xFF;
+        
+        if (is_float)
+        {
+            float px[4];
+            for (uint8_t c = 0; c < 3; c += 1)
+            {
+                uint16_t val = samples[components >= 3 ? c : 0];
+                px[c] = is_16bit ? format_linear_u16(format, val) : format->linear_u8[val];
+            }
+            px[3] = alpha / (is_16bit ? 65535.0f : 255.0f);
+            memcpy(&out[x * out_step], px, sizeof(px));
+        }
+        else
+        {
+            uint16_t px[4];
+            for (uint8_t c = 0; c < 3; c += 1)
+            {
+                uint16_t val = samples[components >= 3 ? c : 0];
+                px[c] = is_16bit ? format_gamma_u16(format, val) : format->gamma_u8[val] * 257;
+            }
+            px[3] = is_16bit ? alpha : alpha * 257;
+            memcpy(&out[x * out_step], px, sizeof(px));
+        }
+    }
+}
+
+static inline void format_pixels_wide_from(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const wpng_row_format * format, const uint8_t components, uint8_t is_16bit)
+{
+    uint8_t is_float = format->pixel_format == WPNG_FORMAT_RGBA32F;
+    if (is_16bit && is_float)
+        format_pixels_wide(in, count, out, out_step, format, components, 1, 1);
+    else if (is_16bit)
+        format_pixels_wide(in, count, out, out_step, format, components, 1, 0);
+    else if (is_float)
+        format_pixels_wide(in, count, out, out_step, format, components, 0, 1);
+    else
+        format_pixels_wide(in, count, out, out_step, format, components, 0, 0);
+}
+
+// converts `count` packed pixels in the png's layout (as convert_row_native outputs them) to format->pixel_format, writing each pixel `out_step` bytes after the previous one
+static void format_pixels(const uint8_t * in, size_t count, uint8_t * out, size_t out_step, const wpng_row_format * format)
+{
+    uint8_t is_16bit = format->bit_depth == 16 && !format->force_8bit;
+    uint8_t components = is_16bit ? format->out_bpp / 2 : format->out_bpp;
+    
+    if (format->pixel_format == WPNG_FORMAT_RGBA16 || format->pixel_format == WPNG_FORMAT_RGBA32F)
+    {
+        switch (components)
+        {
+        case 1: format_pixels_wide_from(in, count, out, out_step, format, 1, is_16bit); break;
+        case 2: format_pixels_wide_from(in, count, out, out_step, format, 2, is_16bit); break;
+        case 3: format_pixels_wide_from(in, count, out, out_step, format, 3, is_16bit); break;
+        default: format_pixels_wide_from(in, count, out, out_step, format, 4, is_16bit); break;
+        }
+        return;
+    }
+    
+    switch (components)
+    {
+    case 1: format_pixels_u8_from(in, count, out, out_step, format->gamma_u8, 1, format->pixel_format); break;
+    case 2: format_pixels_u8_from(in, count, out, out_step, format->gamma_u8, 2, format->pixel_format); break;
+    case 3: format_pixels_u8_from(in, count, out, out_step, format->gamma_u8, 3, format->pixel_format); break;
+    default: format_pixels_u8_from(in, count, out, out_step, format->gamma_u8, 4, format->pixel_format); break;
+    }
+}
+
+// converts `count` pixels of a defiltered scanline, starting from pixel `first`, to the output format, writing each pixel `out_step` bytes after the previous one
+// `temp` needs room for `count` pixels in the png's layout (format->out_bpp bytes each), for pixel formats other than WPNG_FORMAT_PNG
+static void convert_row(const uint8_t * row, size_t first, size_t count, uint8_t * out, size_t out_step, const wpng_row_format * format, uint8_t * temp)
+{
+    if (format->pixel_format == WPNG_FORMAT_PNG)
+    {
+        convert_row_native(row, first, count, out, out_step, format);
+        return;
+    }
+    
+    // palette entries are converted up front, so these go straight from the scanline to the pixel format
+    if (format->format_palette)
+    {
+        convert_row_lookup_from(row, first, count, out, out_step, format->format_palette, wpng_format_bpp[format->pixel_format], format->bit_depth);
+        return;
+    }
+    
+    if (!format->needs_conversion)
+    {
+        format_pixels(&row[first * format->bpp], count, out, out_step, format);
+        return;
+    }
+    convert_row_native(row, first, count, temp, format->out_bpp, format);
+    format_pixels(temp, count, out, out_step, format);
+}
+
+enum {
+    WPNG_READ_SKIP_CRC = 1, // don't check chunk CRCs 
+    WPNG_READ_SKIP_CRITICAL_CHUNKS = 2, // skip unknown critical chunks
+    WPNG_READ_SKIP_GAMMA_CORRECTION = 4, // don't apply gamma correction
+    WPNG_READ_SKIP_IDAT_CRC = 8, // like chrome
+    WPNG_READ_ERROR_ON_BAD_ANCILLARY_CRC = 16, // treat chunks with bad CRCs like unknown chunks
+    WPNG_READ_SKIP_ADLER32 = 32, // don't check zlib checksums
+    WPNG_READ_FORCE_8BIT = 256, // convert 16-bit images to 8-bit on load
+    WPNG_READ_NO_THREADS = 512, // decode on the calling thread only, even if the png has a band index (see WPNG_WRITE_PARALLEL_DECODE) or is interlaced
+    WPNG_READ_PARTIAL = 1024, // the buffer can end partway through the file (e.g. while it's still downloading): decode as much of the image as there is data for
+    WPNG_READ_FORMAT_MASK = 0xF000, // output pixel format, set with WPNG_READ_FORMAT(WPNG_FORMAT_...)
+};
+
+// output:
+
+typedef struct {
+    uint8_t * data;               // u8 array
+    size_t size;                  // size of array
+    size_t bytes_per_scanline;    // width
+    uint32_t width;               // height
+    uint32_t height;              // bytes per pixel
+    float gamma;                  // is 16 bit or not (decoder output)
+    uint8_t bytes_per_pixel;      // was originally 16 bit or not (original png file)
+    uint8_t is_16bit;             // png file specified that it was srgb or not
+    uint8_t was_16bit;            // scanline byte count
+    uint8_t was_srgb;             // gamma (-1 if unset or srgb)
+    uint8_t error;                
+    uint8_t is_partial;           // decoding stopped before the whole image was decoded (WPNG_READ_PARTIAL, or a progress callback), so some of it is left as zeroes
+    uint16_t palette_size;        // for WPNG_FORMAT_INDEX8 and WPNG_FORMAT_INDEX_PACKED: number of colors in palette, otherwise 0
+    uint8_t palette[1024];        // rgba color of each index, gamma corrected like WPNG_FORMAT_RGBA8 would be
+} wpng_load_output;
+// NOTE: the decoder ALWAYS output srgb data, even if was_srgb is unset!
+
+// output of wpng_probe: the same metadata as wpng_load_output, plus what the png file itself says
+typedef struct {
+    size_t size;                  // size of the array wpng_load would output
+    size_t bytes_per_scanline;
+    uint32_t width;
+    uint32_t height;
+    float gamma;                  // gamma wpng_load would correct from (-1 if unset, srgb, or skipped)
+    uint8_t bytes_per_pixel;
+    uint8_t is_16bit;             // decoder output
+    uint8_t was_16bit;            // original png file
+    uint8_t was_srgb;
+    uint8_t bit_depth;            // of the png file, per sample
+    uint8_t color_type;           // of the png file: 0 = gray, 2 = rgb, 3 = indexed, 4 = gray + alpha, 6 = rgba
+    uint8_t is_interlaced;
+    uint8_t has_trns;
+    uint8_t has_gama;
+    uint8_t error;
+    uint16_t palette_size;        // as in wpng_load_output
+    uint8_t palette[1024];
+} wpng_info;
+
+// a chunk of a png, pointing into the buffer it was read from instead of being copied out of it
+typedef struct {
+    const uint8_t * data; // chunk contents, followed by their crc
+    uint32_t size; // of data, without the crc
+    size_t offset; // where the chunk (its length field) starts in the buffer
+    char name[5]; // e.g. "tEXt", null terminated
+    // properties given by the case of the name's letters:
+    uint8_t is_critical; // needed to decode the image, e.g. IHDR
+    uint8_t is_private; // not defined by the png spec, e.g. wpBI
+    uint8_t is_safe_to_copy; // can be kept by editors that change the image data, e.g. tEXt
+} wpng_chunk;
+
+// called by wpng_load and co. for each chunk they read, in file order, after its crc is checked (ancillary chunks with bad crcs are skipped) and before it's interpreted
+// the chunk is only valid during the call; return 0 to keep going, or anything else to stop decoding with error 16, e.g. at the first IDAT chunk, once the metadata is read
+typedef uint8_t (*wpng_chunk_func)(void * userdata, const wpng_chunk * chunk);
+
+// how far along a progressive decode is (see wpng_progress_func)
+typedef struct {
+    const uint8_t * data; // the output image as it is so far, laid out like it will be in wpng_load_output (or dest)
+    size_t bytes_per_scanline;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rows; // rows from the top that are finished; for interlaced images, 0 until the last pass is done
+    uint8_t pass; // adam7 pass that was just finished (1 to 7), or 0 if the image isn't interlaced
+    uint8_t is_filled; // whether the pixels that later passes will decode have been filled in with copies of the ones decoded so far
+} wpng_progress;
+
+// called by a decoder that has one while it decodes: for interlaced images after every adam7 pass, and for others every decoder.progress_rows rows,
+//  once the last row is done, and when the data runs out with WPNG_READ_PARTIAL
+// gamma correction of WPNG_FORMAT_PNG output is only done after the whole image (pixel formats are corrected as they go)
+// return 0 to keep going, or anything else to stop decoding; the image is then output as it is (with is_partial set if it isn't finished)
+typedef uint8_t (*wpng_progress_func)(void * userdata, const wpng_progress * progress);
+
+// default limits for wpng_limits_default, and so for wpng_load, wpng_probe and new decoders; 0 means no limit
+#ifndef WPNG_DEFAULT_MAX_WIDTH
+#define WPNG_DEFAULT_MAX_WIDTH 0
+#endif
+#ifndef WPNG_DEFAULT_MAX_HEIGHT
+#define WPNG_DEFAULT_MAX_HEIGHT 0
+#endif
+#ifndef WPNG_DEFAULT_MAX_PIXELS
+#define WPNG_DEFAULT_MAX_PIXELS 0
+#endif
+#ifndef WPNG_DEFAULT_MAX_DECODED_BYTES
+#define WPNG_DEFAULT_MAX_DECODED_BYTES 0
+#endif
+#ifndef WPNG_DEFAULT_MAX_CHUNKS
+#define WPNG_DEFAULT_MAX_CHUNKS 0
+#endif
+#ifndef WPNG_DEFAULT_MAX_ANCILLARY_BYTES
+#define WPNG_DEFAULT_MAX_ANCILLARY_BYTES 0
+#endif
+// zlib streams that go on after the last row of the image are tolerated (like libpng does), but only this far
+#ifndef WPNG_DEFAULT_MAX_EXTRA_IMAGE_DATA
+#define WPNG_DEFAULT_MAX_EXTRA_IMAGE_DATA (1 << 20)
+#endif
+
+// limits on what a decoder accepts, to bound the memory and time that hostile files can make it spend; 0 means no limit
+// they're all checked before the output image is allocated, except max_extra_image_data, which is checked as the image data is decompressed
+typedef struct {
+    uint32_t max_width; // error 17
+    uint32_t max_height; // error 17
+    uint64_t max_pixels; // width * height, error 17
+    uint64_t max_decoded_bytes; // size of the output image (wpng_load_output.size), error 18
+    uint64_t max_chunks; // error 19
+    uint64_t max_ancillary_bytes; // total size of all the ancillary chunks' data, error 20
+    uint64_t max_extra_image_data; // decompressed image data past what the header says there is, error 21
+} wpng_limits;
+
+static inline void wpng_limits_default(wpng_limits * limits)
+{
+    limits->max_width = WPNG_DEFAULT_MAX_WIDTH;
+    limits->max_height = WPNG_DEFAULT_MAX_HEIGHT;
+    limits->max_pixels = WPNG_DEFAULT_MAX_PIXELS;
+    limits->max_decoded_bytes = WPNG_DEFAULT_MAX_DECODED_BYTES;
+    limits->max_chunks = WPNG_DEFAULT_MAX_CHUNKS;
+    limits->max_ancillary_bytes = WPNG_DEFAULT_MAX_ANCILLARY_BYTES;
+    limits->max_extra_image_data = WPNG_DEFAULT_MAX_EXTRA_IMAGE_DATA;
+}
+
+// memory allocation callbacks for wpng_decoder; userdata is passed back to both
+// alloc must return memory aligned like malloc's, or null on failure. free is given null sometimes
+typedef struct {
+    void * (*alloc)(void * userdata, size_t size);
+    void (*free)(void * userdata, void * ptr);
+    void * userdata;
+} wpng_allocator;
+
+// scratch buffers that a wpng_decoder keeps between decodes
+enum {
+    WPNG_SCRATCH_ROWS, // current and previous scanline
+    WPNG_SCRATCH_INFLATE, // huffman tables and lookback window
+    WPNG_SCRATCH_WIDE_ROW, // full size row, for box filtering
+    WPNG_SCRATCH_BOX_SUMS,
+    WPNG_SCRATCH_FORMAT_ROW, // row in the png's layout, for converting to a pixel format
+    WPNG_SCRATCH_GAMMA, // 16-bit gamma table
+    WPNG_SCRATCH_BANDS, // per band state, for band-indexed pngs
+    WPNG_SCRATCH_BAND_THREADS, // per thread inflate memory and scanlines, for band-indexed pngs
+    WPNG_SCRATCH_FILE, // contents of files that aren't memory mapped, for wpng_decoder_load_file
+    WPNG_SCRATCH_BATCH, // order to decode images in, for wpng_decoder_load_batch
+    WPNG_SCRATCH_PASS_THREADS, // per thread rows, for deinterlacing
+    WPNG_SCRATCH_COUNT,
+};
+
+// reusable decoding context: an allocator, plus scratch memory that's only ever grown, so that decoding many images in a row
+//  doesn't allocate anything but the output images (or nothing at all, with wpng_decoder_load_into)
+// one decoder can only decode one image at a time; use one per thread
+typedef struct {
+    wpng_allocator allocator;
+    uint8_t * scratch[WPNG_SCRATCH_COUNT];
+    size_t scratch_size[WPNG_SCRATCH_COUNT];
+    wpng_limits limits; // wpng_limits_default unless changed after wpng_decoder_init
+    wpng_chunk_func chunk_callback; // optional, see wpng_chunk_func; set it after wpng_decoder_init
+    void * chunk_userdata;
+    wpng_progress_func progress_callback; // optional, see wpng_progress_func
+    void * progress_userdata;
+    uint32_t progress_rows; // for images that aren't interlaced: how many rows to call progress_callback after, or 0 for only once they're all done
+    uint8_t progress_fill; // for interlaced images: fill in the pixels of later passes before calling progress_callback (only when decoding from the top left, at full size)
+} wpng_decoder;
+
+// `allocator` can be null to use malloc and free; it's copied
+static inline void wpng_decoder_init(wpng_decoder * decoder, const wpng_allocator * allocator)
+{
+    memset(decoder, 0, sizeof(wpng_decoder));
+    if (allocator)
+        decoder->allocator = *allocator;
+    wpng_limits_default(&decoder->limits);
+}
+
+static inline void * wpng_alloc(wpng_decoder * decoder, size_t size)
+{
+    if (decoder->allocator.alloc)
+        return decoder->allocator.alloc(decoder->allocator.userdata, size);
+    return malloc(size);
+}
+
+static inline void wpng_free(wpng_decoder * decoder, void * ptr)
+{
+    if (decoder->allocator.free)
+        decoder->allocator.free(decoder->allocator.userdata, ptr);
+    else
+        free(ptr);
+}
+
+// returns scratch buffer `slot` with room for at least `size` bytes (contents undefined), or null if it can't be allocated
+static void * wpng_scratch(wpng_decoder * decoder, uint8_t slot, size_t size)
+{
+    if (decoder->scratch[slot] && decoder->scratch_size[slot] >= size)
+        return decoder->scratch[slot];
+    wpng_free(decoder, decoder->scratch[slot]);
+    decoder->scratch[slot] = (uint8_t *)wpng_alloc(decoder, size);
+    decoder->scratch_size[slot] = decoder->scratch[slot] ? size : 0;
+    return decoder->scratch[slot];
+}
+
+// frees the decoder's scratch memory, but not any images it decoded
+static inline void wpng_decoder_free(wpng_decoder * decoder)
+{
+    for (size_t i = 0; i < WPNG_SCRATCH_COUNT; i += 1)
+    {
+        wpng_free(decoder, decoder->scratch[i]);
+        decoder->scratch[i] = 0;
+        decoder->scratch_size[i] = 0;
+    }
+}
+
+// steps the inflater over the framing between consecutive IDAT chunks (crc, length, name), so it can read straight out of the file
+static uint8_t wpng_next_idat(void * userdata, size_t * pos, size_t * end)
+{
+    const byte_buffer * buf = (const byte_buffer *)userdata;
+    size_t next = *end + 4;
+    if (next + 8 > buf->len || memcmp(&buf->data[next + 4], "IDAT", 4) != 0)
+        return 0;
+    size_t size = ((size_t)buf->data[next] << 24) | ((size_t)buf->data[next + 1] << 16) | ((size_t)buf->data[next + 2] << 8) | buf->data[next + 3];
+    // (only with WPNG_READ_PARTIAL: the last chunk is cut short, and whatever there is of it is used)
+    if (next + 8 + size > buf->len)
+        size = buf->len - next - 8;
+    *pos = next + 8;
+    *end = next + 8 + size;
+    return 1;
+}
+
+static inline void box_add_row_u8(const uint8_t * row, uint32_t width, uint8_t scale, uint32_t * sums, const uint8_t samples)
+{
+    for (size_t x = 0; x < width; sums += samples)
+    {
+        size_t block_end = width - x < scale ? width : x + scale;
+        for (; x < block_end; x += 1)
+        {
+            for (uint8_t c = 0; c < samples; c += 1)
+                sums[c] += row[x * samples + c];
+        }
+    }
+}
+
+// adds each sample of a converted scanline into the sum for its block of `scale` pixels, for box filtered downscaling
+static void box_add_row(const uint8_t * row, uint32_t width, uint8_t scale, uint8_t out_bpp, uint8_t is_16bit, uint32_t * sums)
+{
+    if (!is_16bit)
+    {
+        switch (out_bpp)
+        {
+        case 1: box_add_row_u8(row, width, scale, sums, 1); break;
+        case 2: box_add_row_u8(row, width, scale, sums, 2); break;
+        case 3: box_add_row_u8(row, width, scale, sums, 3); break;
+        default: box_add_row_u8(row, width, scale, sums, 4); break;
+        }
+        return;
+    }
+    
+    uint8_t samples = out_bpp / 2;
+    for (size_t x = 0; x < width; x += 1)
+    {
+        uint32_t * sum = &sums[x / scale * samples];
+        for (uint8_t c = 0; c < samples; c += 1)
+            sum[c] += ((uint32_t)row[(x * samples + c) * 2] << 8) | row[(x * samples + c) * 2 + 1];
+    }
+}
+
+// writes the rounded averages of the sums made by box_add_row over `row_count` rows into out, then clears them
+// the last block of a scanline can be less than `scale` pixels wide
+static void box_resolve_row(uint32_t * sums, uint32_t width, uint8_t scale, uint32_t row_count, uint8_t out_bpp, uint8_t is_16bit, uint8_t * out)
+{
+    uint8_t samples = is_16bit ? out_bpp / 2 : out_bpp;
+    size_t out_width = (width + scale - 1) / scale;
+    for (size_t x = 0; x < out_width; x += 1)
+    {
+        uint32_t block_width = width - x * scale < scale ? width - x * scale : scale;
+        uint32_t count = block_width * row_count;
+        for (uint8_t c = 0; c < samples; c += 1)
+        {
+            uint32_t val = (sums[x * samples + c] + count / 2) / count;
+            if (is_16bit)
+            {
+                out[(x * samples + c) * 2] = val >> 8;
+                out[(x * samples + c) * 2 + 1] = val;
+            }
+            else
+                out[x * samples + c] = val;
+            sums[x * samples + c] = 0;
+        }
+    }
+}
+
+// everything about a png that comes before its image data
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t interlacing;
+    uint8_t has_trns;
+    uint8_t is_srgb;
+    float gamma; // -1 if there's no gAMA chunk
+    uint32_t transparent_r;
+    uint32_t transparent_g;
+    uint32_t transparent_b;
+    uint16_t palette_size;
+    uint8_t palette[1024]; // rgba
+    // location of the first IDAT chunk's data; the rest are found by wpng_next_idat
+    size_t idat_start;
+    size_t idat_size;
+    uint64_t idat_total; // size of all the IDAT chunks' data together (just the first's with stop_at_idat)
+    // band index from a wpBI chunk (see WPNG_WRITE_PARALLEL_DECODE); band_count is 0 if there isn't one
+    size_t band_index; // location of the offsets of the bands after the first
+    uint32_t band_rows;
+    uint32_t band_count;
+    size_t error_offset; // start of the chunk (its length field) that was being read when an error happened, or where reading stopped
+    uint8_t error;
+} wpng_header;
+
+#define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { output->error = (ERRVAL); return; } }
+    // 1 - chunk size error
+    // 2 - buffer overflow
+    // 3 - invalid chunk name
+    // 4 - failed crc
+    // 5 - chunk syntax error or invalid value within chunk
+    // 6 - chunk ordering error
+    // 7 - unknown critical chunk
+    // 8 - missing mandatory chunk (IHDR/IDAT/IEND)
+    // 9 - has chunk that's forbidden for given color format
+    // 10 - missing contextual mandatory chunk (PLTE on indexed images)
+    // 11 - invalid zlib data
+    // 12 - destination buffer too small (wpng_load_into)
+    // 13 - invalid region or scale (wpng_load_region, wpng_load_scaled)
+    // 14 - invalid pixel format, or one the image can't be output in
+    // 15 - file can't be opened or read (wpng_load_file)
+    // 16 - stopped by the chunk callback (wpng_chunk_func)
+    // 17 - image is wider, taller or has more pixels than the limits allow (wpng_limits)
+    // 18 - output image would be bigger than the limits allow
+    // 19 - more chunks than the limits allow
+    // 20 - more ancillary chunk data than the limits allow
+    // 21 - image data decompresses to too much more than the header says it has, or can't possibly decompress to enough
+    // 100 - allocation failure
+    // 255 - not a png file
+    
+
+// walks through the chunks of a png without decompressing or copying anything, e.g. to read metadata from a lot of files quickly
+// only the signature, chunk sizes and chunk names are checked: not crcs (see wpng_chunk_crc_ok), ordering, or contents
+typedef struct {
+    const byte_buffer * buf;
+    size_t next; // where the next chunk starts
+    uint8_t done;
+    uint8_t error; // once wpng_chunk_next returns 0: 0 if the chunks ended normally, otherwise 1, 2, 3 or 255, as for wpng_load
+} wpng_chunk_iter;
+
+static inline void wpng_chunk_iter_init(wpng_chunk_iter * iter, const byte_buffer * buf)
+{
+    assert(buf);
+    assert(buf->data);
+    memset(iter, 0, sizeof(wpng_chunk_iter));
+    iter->buf = buf;
+    iter->next = 8;
+}
+
+static inline void wpng_chunk_fill(wpng_chunk * chunk, const uint8_t * start, size_t offset, uint32_t size)
+{
+    chunk->data = start + 8;
+    chunk->size = size;
+    chunk->offset = offset;
+    memcpy(chunk->name, start + 4, 4);
+    chunk->name[4] = 0;
+    chunk->is_critical = !(chunk->name[0] & 0x20);
+    chunk->is_private = !!(chunk->name[1] & 0x20);
+    chunk->is_safe_to_copy = !!(chunk->name[3] & 0x20);
+}
+
+// reads the next chunk into chunk and returns 1, or returns 0 after IEND, at the end of the buffer, or on error (see iter->error)
+static inline uint8_t wpng_chunk_next(wpng_chunk_iter * iter, wpng_chunk * chunk)
+{
+    const byte_buffer * buf = iter->buf;
+    if (iter->done)
+        return 0;
+    iter->done = 1;
+    
+    if (iter->next == 8 && (buf->len < 8 || memcmp(buf->data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0))
+    {
+        iter->error = 255;
+        return 0;
+    }
+    if (iter->next >= buf->len)
+        return 0;
+    
+    const uint8_t * start = &buf->data[iter->next];
+    if (buf->len - iter->next < 8)
+    {
+        iter->error = 2;
+        return 0;
+    }
+    uint32_t size = ((uint32_t)start[0] << 24) | ((uint32_t)start[1] << 16) | ((uint32_t)start[2] << 8) | start[3];
+    if (size >= 0x80000000)
+    {
+        iter->error = 1;
+        return 0;
+    }
+    if (buf->len - iter->next - 8 < (size_t)size + 4)
+    {
+        iter->error = 2;
+        return 0;
+    }
+    for (size_t i = 4; i < 8; i += 1)
+    {
+        uint8_t upcased = start[i] | 0x20;
+        if (upcased < 97 || upcased > 122)
+        {
+            iter->error = 3;
+            return 0;
+        }
+    }
+    
+    wpng_chunk_fill(chunk, start, iter->next, size);
+    iter->next += (size_t)size + 12;
+    iter->done = memcmp(chunk->name, "IEND", 4) == 0;
+    return 1;
+}
+
+static inline uint8_t wpng_chunk_crc_ok(const wpng_chunk * chunk)
+{
+    const uint8_t * crc = chunk->data + chunk->size;
+    uint32_t expected = ((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3];
+    return infl_compute_crc32(chunk->data - 4, chunk->size + 4, 0) == expected;
+}
+
+// validates the signature and chunks of a png and reads its header into output
+// with stop_at_idat, stops at the first IDAT chunk instead of reading up to IEND
+// callback, if not null, is given every chunk that's read (see wpng_chunk_func)
+// limits on the dimensions and chunks are checked as soon as they're read
+// on error, writes nonzero to the "error" value of output
+static void wpng_read_chunks(byte_buffer * buf, uint32_t flags, uint8_t stop_at_idat, const wpng_limits * limits, wpng_chunk_func callback, void * userdata, wpng_header * output)
+{
+    assert(output);
+    assert(buf);
+    assert(buf->data);
+    
+    output->error_offset = 0;
+	if (buf->len < 8 || memcmp(buf->data, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8) != 0)
+    {
+        output->error = 255;
+		return;
+    }
+    buf->cur = 8;
+    
+    size_t idat_start = 0;
+    size_t idat_size = 0;
+    
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t bit_depth = 0;
+    uint8_t color_type = 0;
+    uint8_t interlacing = 0;
+    
+    uint8_t * palette = output->palette;
+    memset(palette, 0, sizeof(output->palette));
+    uint16_t palette_size = 0;
+    uint8_t has_idat = 0;
+    uint8_t has_iend = 0;
+    
+    uint8_t has_trns = 0;
+    uint8_t has_chrm = 0;
+    uint8_t has_gama = 0;
+    uint8_t has_iccp = 0;
+    uint8_t has_sbit = 0;
+    uint8_t has_bkgd = 0;
+    uint8_t has_hist = 0;
+    uint8_t has_phys = 0;
+    uint8_t has_time = 0;
+    
+    uint32_t transparent_r = 0xFFFFFFFF;
+    uint32_t transparent_g = 0xFFFFFFFF;
+    uint32_t transparent_b = 0xFFFFFFFF;
+    
+    uint64_t chunk_count = 0;
+    uint64_t ancillary_bytes = 0;
+    uint64_t idat_total = 0;
+    
+    uint8_t is_srgb = 0;
+    float gamma = -1.0;
+    
+    size_t band_index = 0;
+    uint32_t band_rows = 0;
+    uint32_t band_count = 0;
+    
+    uint8_t prev_was_idat = 0; // multiple idat chunks must be consecutive
+    while (buf->cur < buf->len)
+    {
+        output->error_offset = buf->cur;
+        chunk_count += 1;
+        WPNG_ASSERT(!limits->max_chunks || chunk_count <= limits->max_chunks, 19);
+        
+        // with WPNG_READ_PARTIAL, the buffer can end anywhere: a chunk that's cut short ends the file, except that what there is of an IDAT chunk gets decompressed
+        uint8_t is_cut_short = 0;
+        if (flags & WPNG_READ_PARTIAL)
+        {
+            if (buf->len - buf->cur < 8)
+                break;
+            const uint8_t * start = &buf->data[buf->cur];
+            uint32_t full_size = ((uint32_t)start[0] << 24) | ((uint32_t)start[1] << 16) | ((uint32_t)start[2] << 8) | start[3];
+            is_cut_short = (uint64_t)full_size + 12 > buf->len - buf->cur;
+            if (is_cut_short && memcmp(&start[4], "IDAT", 4) != 0)
+                break;
+        }
+        else
+            WPNG_ASSERT(buf->len - buf->cur >= 12, 2); // a chunk's length, name and crc must all be there before any of them are read
+        
+        uint32_t size = byteswap_int(bytes_pop_int(buf, 4), 4);
+        WPNG_ASSERT(size < 0x80000000, 1); // must be 31 bit
+        if (is_cut_short && size > buf->len - buf->cur - 4)
+            size = buf->len - buf->cur - 4;
+        WPNG_ASSERT(is_cut_short || buf->cur + size + 8 <= buf->len, 2); // must not overflow buffer
+        
+        size_t chunk_start = buf->cur;
+        char name[5] = {0};
+        for (size_t i = 0; i < 4; i += 1)
+        {
+            name[i] = byte_pop(buf);
+            uint8_t upcased = name[i] | 0x20;
+            WPNG_ASSERT(upcased >= 97 && upcased <= 122, 3);
+        }
+        uint8_t critical = !(name[0] & 0x20);
+        if (!critical)
+        {
+            ancillary_bytes += size;
+            WPNG_ASSERT(!limits->max_ancillary_bytes || ancillary_bytes <= limits->max_ancillary_bytes, 20);
+        }
+        
+        // everything that describes the image comes before the image data
+        if (stop_at_idat && memcmp(name, "IDAT", 4) == 0)
+        {
+            idat_start = buf->cur;
+            idat_size = size;
+            idat_total = size;
+            has_idat = 1;
+            break;
+        }
+        
+        size_t cur_start = buf->cur;
+        
+        uint8_t checksum_failed = 0;
+        if (!is_cut_short && !(flags & WPNG_READ_SKIP_CRC) && !((flags & WPNG_READ_SKIP_IDAT_CRC) && memcmp(name, "IDAT", 4) == 0))
+        {
+            buf->cur = cur_start + size;
+            uint32_t expected_checksum = byteswap_int(bytes_pop_int(buf, 4), 4);
+            uint32_t checksum = infl_compute_crc32(&buf->data[chunk_start], size + 4, 0);
+            checksum_failed = (checksum != expected_checksum);
+        }
+        
+        // always check CRC for critical chunks
+        if (critical)
+            WPNG_ASSERT(!checksum_failed, 4);
+        // skip ancillary chunks with bad checksums, unless the option is set to error instead
+        if (checksum_failed)
+        {
+            if (flags & WPNG_READ_ERROR_ON_BAD_ANCILLARY_CRC)
+                WPNG_ASSERT(!checksum_failed, 4)
+            else
+            {
+                buf->cur = cur_start + size + 4;
+                continue;
+            }
+        }
+        
+        buf->cur = cur_start;
+        
+        if (callback)
+        {
+            wpng_chunk chunk;
+            wpng_chunk_fill(&chunk, &buf->data[chunk_start - 4], chunk_start - 4, size);
+            WPNG_ASSERT(!callback(userdata, &chunk), 16);
+        }
+        
+        if (memcmp(name, "IHDR", 4) == 0)
+        {
+            WPNG_ASSERT(size == 13, 5);
+            WPNG_ASSERT(chunk_count == 1, 6); // must be first
+            WPNG_ASSERT(width == 0 && height == 0, 6); // must not have multiple
+            
+            width = byteswap_int(bytes_pop_int(buf, 4), 4);
+            height = byteswap_int(bytes_pop_int(buf, 4), 4);
+            WPNG_ASSERT(width != 0 && height != 0, 5); // must be coherent
+            WPNG_ASSERT(!limits->max_width || width <= limits->max_width, 17);
+            WPNG_ASSERT(!limits->max_height || height <= limits->max_height, 17);
+            WPNG_ASSERT(!limits->max_pixels || (uint64_t)width * height <= limits->max_pixels, 17);
             
             bit_depth = byte_pop(buf);
             WPNG_ASSERT(bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16, 5);
@@ -453,7 +1528,12 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
         else if (memcmp(name, "IDAT", 4) == 0)
         {
             WPNG_ASSERT(!has_idat || prev_was_idat, 6); // multiple idat chunks must be consecutive
-            bytes_push(&idat, &buf->data[buf->cur], size);
+            if (!has_idat)
+            {
+                idat_start = buf->cur;
+                idat_size = size;
+            }
+            idat_total += size;
             has_idat = 1;
         }
         else if (memcmp(name, "PLTE", 4) == 0)
@@ -501,264 +1581,1362 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
                 transparent_g = val;
                 transparent_b = val;
             }
-            // rgb
-            if (color_type == 2)
+            // rgb
+            if (color_type == 2)
+            {
+                WPNG_ASSERT(size == 6, 5);
+                uint16_t val_r = byteswap_int(bytes_pop_int(buf, 2), 2);
+                WPNG_ASSERT(val_r < (1 << bit_depth), 5);
+                uint16_t val_g = byteswap_int(bytes_pop_int(buf, 2), 2);
+                WPNG_ASSERT(val_g < (1 << bit_depth), 5);
+                uint16_t val_b = byteswap_int(bytes_pop_int(buf, 2), 2);
+                WPNG_ASSERT(val_b < (1 << bit_depth), 5);
+                transparent_r = val_r;
+                transparent_g = val_g;
+                transparent_b = val_b;
+            }
+            has_trns = 1;
+        }
+        else if (memcmp(name, "wpBI", 4) == 0)
+        {
+            // it's only a hint for decoding faster, so if it's broken it gets ignored like an unknown chunk
+            if (!has_idat && !band_count && size >= 4 && size % 4 == 0)
+            {
+                band_rows = byteswap_int(bytes_pop_int(buf, 4), 4);
+                band_index = buf->cur;
+                band_count = size / 4;
+            }
+        }
+        else if (memcmp(name, "IEND", 4) == 0)
+        {
+            has_iend = 1;
+            break;
+        }
+        else
+        {
+            if (!(flags & WPNG_READ_SKIP_CRITICAL_CHUNKS))
+                WPNG_ASSERT(!critical, 7); // unknown chunks must not be critical
+        }
+        
+        prev_was_idat = (memcmp(name, "IDAT", 4) == 0);
+        
+        WPNG_ASSERT(width != 0 && height != 0, 8); // header must exist and give valid width/height values
+        
+        buf->cur = cur_start + size + 4;
+        if (is_cut_short)
+            break;
+    }
+    output->error_offset = buf->cur;
+    WPNG_ASSERT(has_idat, 8);
+    WPNG_ASSERT(has_iend || stop_at_idat || (flags & WPNG_READ_PARTIAL), 8);
+    WPNG_ASSERT(width != 0 && height != 0, 8); // header must exist
+    
+    if (color_type == 4 || color_type == 6)
+        WPNG_ASSERT(has_trns == 0, 9);
+    if (color_type == 0 || color_type == 4)
+        WPNG_ASSERT(palette_size == 0, 9);
+    if (color_type == 3)
+        WPNG_ASSERT(palette_size != 0, 10);
+    
+    output->width = width;
+    output->height = height;
+    output->bit_depth = bit_depth;
+    output->color_type = color_type;
+    output->interlacing = interlacing;
+    output->has_trns = has_trns;
+    output->is_srgb = is_srgb;
+    output->gamma = gamma;
+    output->transparent_r = transparent_r;
+    output->transparent_g = transparent_g;
+    output->transparent_b = transparent_b;
+    output->palette_size = palette_size;
+    output->idat_start = idat_start;
+    output->idat_size = idat_size;
+    output->idat_total = idat_total;
+    output->band_index = band_index;
+    output->band_rows = band_rows;
+    output->band_count = band_count;
+    output->error = 0;
+}
+
+// bytes per pixel of the image wpng_load outputs: Y/YA/RGB/RGBA, with alpha if there's a tRNS chunk, or the pixel format's size
+static uint8_t wpng_output_bpp(const wpng_header * header, uint32_t flags)
+{
+    uint8_t pixel_format = wpng_read_format(flags);
+    if (pixel_format != WPNG_FORMAT_PNG && pixel_format < WPNG_FORMAT_COUNT)
+        return wpng_format_bpp[pixel_format];
+    
+    uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
+    uint8_t out_bpp = temp[header->color_type] + header->has_trns;
+    if (header->color_type == 3)
+        out_bpp = 3 + header->has_trns;
+    if (header->bit_depth == 16 && !(flags & WPNG_READ_FORCE_8BIT))
+        out_bpp *= 2;
+    return out_bpp;
+}
+
+static uint8_t wpng_output_is_16bit(const wpng_header * header, uint32_t flags)
+{
+    uint8_t pixel_format = wpng_read_format(flags);
+    if (pixel_format != WPNG_FORMAT_PNG)
+        return pixel_format == WPNG_FORMAT_RGBA16;
+    return header->bit_depth == 16 && !(flags & WPNG_READ_FORCE_8BIT);
+}
+
+static inline uint8_t wpng_is_index_format(uint8_t pixel_format)
+{
+    return pixel_format == WPNG_FORMAT_INDEX8 || pixel_format == WPNG_FORMAT_INDEX_PACKED;
+}
+
+// whether the image can be output in the pixel format: the index formats need an indexed image, or a gray one of up to 8 bits
+static uint8_t wpng_format_supported(const wpng_header * header, uint32_t flags)
+{
+    uint8_t pixel_format = wpng_read_format(flags);
+    if (pixel_format >= WPNG_FORMAT_COUNT)
+        return 0;
+    if (wpng_is_index_format(pixel_format))
+        return header->color_type == 3 || (header->color_type == 0 && header->bit_depth <= 8);
+    return 1;
+}
+
+// bytes per row of a `width` pixels wide image, as wpng_load outputs it
+static size_t wpng_output_row_size(const wpng_header * header, uint32_t flags, uint32_t width)
+{
+    if (wpng_read_format(flags) == WPNG_FORMAT_INDEX_PACKED)
+        return ((size_t)width * header->bit_depth + 7) / 8;
+    return (size_t)width * wpng_output_bpp(header, flags);
+}
+
+// size of the decompressed image data the header says there is: the scanlines of every pass, with their filter type bytes
+static uint64_t wpng_image_data_size(const wpng_header * header)
+{
+    uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
+    uint64_t size = 0;
+    for (uint8_t pass = header->interlacing ? 1 : 0; pass <= (header->interlacing ? 7 : 0); pass += 1)
+    {
+        uint64_t pass_width = adam7_pass_size(header->width, adam7_x_inits[pass], adam7_x_gaps[pass]);
+        uint64_t pass_height = adam7_pass_size(header->height, adam7_y_inits[pass], adam7_y_gaps[pass]);
+        if (pass_width != 0)
+            size += ((pass_width * header->bit_depth + 7) / 8 * temp[header->color_type] + 1) * pass_height;
+    }
+    return size;
+}
+
+// for the index pixel formats: the color each index stands for, as rgba, gamma corrected with `gamma` (if it's not negative) like WPNG_FORMAT_RGBA8
+// gray images get an entry for every possible sample value; returns the number of entries
+static uint16_t wpng_index_palette(const wpng_header * header, float gamma, uint8_t * palette)
+{
+    uint16_t palette_size = header->palette_size;
+    if (header->color_type == 0)
+    {
+        palette_size = 1 << header->bit_depth;
+        for (uint32_t val = 0; val < palette_size; val += 1)
+        {
+            uint8_t gray = val * (0xFF / (palette_size - 1));
+            palette[val * 4 + 0] = gray;
+            palette[val * 4 + 1] = gray;
+            palette[val * 4 + 2] = gray;
+            palette[val * 4 + 3] = header->has_trns && val == header->transparent_r ? 0 : 0xFF;
+        }
+    }
+    else
+        memcpy(palette, header->palette, palette_size * 4);
+    
+    if (gamma >= 0.0)
+    {
+        const uint8_t * table = get_gamma_table_u8(gamma);
+        for (uint32_t i = 0; i < palette_size; i += 1)
+        {
+            palette[i * 4 + 0] = table[palette[i * 4 + 0]];
+            palette[i * 4 + 1] = table[palette[i * 4 + 1]];
+            palette[i * 4 + 2] = table[palette[i * 4 + 2]];
+        }
+    }
+    return palette_size;
+}
+
+// how many bytes a buffer needs to hold an image at the given stride, with its top left pixel at (x_offset, y_offset)
+// returns 0 if the image's rows don't fit in the stride, or if the size doesn't fit in a size_t
+static inline size_t wpng_dest_size(uint32_t width, uint32_t height, uint8_t bytes_per_pixel, size_t dest_stride, uint32_t x_offset, uint32_t y_offset)
+{
+    size_t row_end = ((size_t)x_offset + width) * bytes_per_pixel;
+    size_t last_row = (size_t)y_offset + height - 1;
+    if (width == 0 || height == 0 || dest_stride < row_end)
+        return 0;
+    if (last_row > (SIZE_MAX - row_end) / dest_stride)
+        return 0;
+    return last_row * dest_stride + row_end;
+}
+
+// pngs written with WPNG_WRITE_PARALLEL_DECODE are split into bands of rows, and have a wpBI chunk that says which IDAT chunk each band starts at
+// each band's compressed data comes right after a full flush, and its first row doesn't refer to the row above, so the bands can be decoded at the same time
+
+// input of one band: IDAT chunks up to the one where the next band starts
+typedef struct {
+    const byte_buffer * buf;
+    size_t stop; // start of the next band's first IDAT chunk (at its length field)
+} wpng_band_input;
+
+static uint8_t wpng_next_band_idat(void * userdata, size_t * pos, size_t * end)
+{
+    const wpng_band_input * input = (const wpng_band_input *)userdata;
+    if (*end + 4 >= input->stop)
+        return 0;
+    return wpng_next_idat((void *)input->buf, pos, end);
+}
+
+typedef struct {
+    const byte_buffer * buf;
+    uint32_t flags;
+    const wpng_row_format * format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t band_rows;
+    uint32_t band_count;
+    const size_t * band_starts; // start of each band's first IDAT chunk (at its length field)
+    uint8_t * image_data;
+    size_t stride;
+    uint8_t out_bpp;
+    // INFL_STREAM_MEMORY_SIZE bytes of inflate memory, then two scanlines, then a row of pixels in the png's layout (for convert_row), per thread
+    uint8_t * thread_memory;
+    size_t thread_memory_size;
+    // per band: whether it decoded, and the adler32 and length of its decompressed data
+    uint8_t * band_ok;
+    uint32_t * band_adler;
+    uint64_t * band_size;
+    uint32_t expected_adler; // from the end of the zlib stream, read by the last band
+    uint64_t max_extra_image_data; // after the last row, as in wpng_limits
+} wpng_band_job;
+
+// decompresses, defilters and converts one band of rows straight into image_data
+// the band only counts as decoded if a serial decoder would have decoded the exact same data for it:
+//  it has to end exactly where the next band starts, on a flush point, and its first row can only use the none or sub filters
+static void wpng_decode_band(void * userdata, size_t band, uint32_t thread)
+{
+    wpng_band_job * job = (wpng_band_job *)userdata;
+    const wpng_row_format * format = job->format;
+    const uint8_t * data = job->buf->data;
+    uint8_t is_last = band + 1 == job->band_count;
+    size_t y_start = band * job->band_rows;
+    size_t y_end = is_last ? job->height : y_start + job->band_rows;
+    size_t bps = ((size_t)job->width * format->bit_depth + 7) / 8 * format->components;
+    job->band_ok[band] = 0;
+    
+    size_t chunk = job->band_starts[band];
+    size_t size = ((size_t)data[chunk] << 24) | ((size_t)data[chunk + 1] << 16) | ((size_t)data[chunk + 2] << 8) | data[chunk + 3];
+    wpng_band_input input = {job->buf, is_last ? SIZE_MAX : job->band_starts[band + 1]};
+    
+    // only the first band has the zlib header; the others start with a block
+    uint8_t * memory = &job->thread_memory[thread * job->thread_memory_size];
+    infl_stream stream;
+    infl_stream_init_with(&stream, data, chunk + 8, chunk + 8 + size, wpng_next_band_idat, &input, band == 0 ? 10 : 0, memory);
+    uint8_t * rows = &memory[INFL_STREAM_MEMORY_SIZE];
+    uint8_t * temp_row = &rows[(bps + 1) * 2];
+    
+    uint8_t is_direct = format->is_raw;
+    uint8_t * row = rows;
+    uint8_t * prev_row = &rows[bps + 1];
+    memset(prev_row, 0, bps + 1);
+    uint32_t adler = 1;
+    uint8_t ok = 1;
+    for (size_t y = y_start; y < y_end; y += 1)
+    {
+        uint8_t * out = &job->image_data[y * job->stride];
+        uint8_t * scanline = is_direct ? out : &row[1];
+        if (infl_stream_read(&stream, row, 1) != 1 || infl_stream_read(&stream, scanline, bps) != bps || (band > 0 && y == y_start && row[0] > 1))
+        {
+            ok = 0;
+            break;
+        }
+        adler = infl_update_adler32(adler, row, 1);
+        adler = infl_update_adler32(adler, scanline, bps);
+        defilter(scanline, is_direct && y > y_start ? out - job->stride : &prev_row[1], bps, row[0], format->bpp);
+        if (!is_direct)
+        {
+            convert_row(scanline, 0, job->width, out, job->out_bpp, format, temp_row);
+            uint8_t * temp = row;
+            row = prev_row;
+            prev_row = temp;
+        }
+    }
+    uint64_t band_size = (uint64_t)(y_end - y_start) * (bps + 1);
+    
+    if (ok && !is_last)
+        ok = infl_stream_read_flush(&stream) && infl_reader_is_empty(&stream.input);
+    // like wpng_decode, anything after the last row is read up to the end of the zlib stream, then comes the checksum
+    while (ok && is_last && stream.state != INFL_STATE_DONE)
+    {
+        size_t amount = infl_stream_read(&stream, rows, bps + 1);
+        adler = infl_update_adler32(adler, rows, amount);
+        band_size += amount;
+        ok = !stream.error && (!job->max_extra_image_data || band_size - (uint64_t)(y_end - y_start) * (bps + 1) <= job->max_extra_image_data);
+    }
+    if (ok && is_last && !(job->flags & WPNG_READ_SKIP_ADLER32))
+    {
+        infl_align_to_byte(&stream.input);
+        job->expected_adler = byteswap_int(infl_bits_pop(&stream.input, 32), 4);
+        ok = !stream.input.overrun;
+    }
+    
+    job->band_adler[band] = adler;
+    job->band_size[band] = band_size;
+    job->band_ok[band] = ok;
+}
+
+// decodes a non-interlaced png with a band index into image_data, on up to thread_count threads
+// returns zero if the index doesn't match the image data or anything else goes wrong; the image then has to be decoded serially (which reports the actual error, if any)
+static uint8_t wpng_decode_bands(wpng_decoder * decoder, byte_buffer * buf, uint32_t flags, const wpng_header * header, const wpng_row_format * format, uint8_t * image_data, size_t stride, uint8_t out_bpp, uint32_t thread_count)
+{
+    uint32_t band_rows = header->band_rows;
+    uint32_t band_count = header->band_count;
+    if (band_rows == 0 || (header->height - 1) / band_rows + 1 != band_count)
+        return 0;
+    if (thread_count > band_count)
+        thread_count = band_count;
+    
+    size_t bps = ((size_t)header->width * format->bit_depth + 7) / 8 * format->components;
+    // (rounded up to keep each thread's inflate memory aligned)
+    size_t temp_row_size = format->pixel_format != WPNG_FORMAT_PNG && !wpng_is_index_format(format->pixel_format) ? (size_t)header->width * format->out_bpp : 0;
+    size_t thread_memory_size = (INFL_STREAM_MEMORY_SIZE + (bps + 1) * 2 + temp_row_size + 15) / 16 * 16;
+    uint8_t * thread_memory = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_BAND_THREADS, thread_memory_size * thread_count);
+    uint8_t * band_memory = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_BANDS, (sizeof(size_t) + sizeof(uint64_t) + sizeof(uint32_t) + 1) * band_count);
+    if (!thread_memory || !band_memory)
+        return 0;
+    size_t * band_starts = (size_t *)band_memory;
+    uint64_t * band_size = (uint64_t *)&band_starts[band_count];
+    uint32_t * band_adler = (uint32_t *)&band_size[band_count];
+    uint8_t * band_ok = (uint8_t *)&band_adler[band_count];
+    
+    // the index has the offset of each band's first IDAT chunk from the first IDAT chunk, in order
+    size_t pos = header->idat_start;
+    size_t end = header->idat_start + header->idat_size;
+    uint32_t found = 1;
+    band_starts[0] = pos - 8;
+    while (found < band_count && wpng_next_idat(buf, &pos, &end))
+    {
+        const uint8_t * entry = &buf->data[header->band_index + (found - 1) * 4];
+        uint32_t offset = ((uint32_t)entry[0] << 24) | ((uint32_t)entry[1] << 16) | ((uint32_t)entry[2] << 8) | entry[3];
+        if (pos - 8 - band_starts[0] == offset)
+            band_starts[found++] = pos - 8;
+    }
+    if (found != band_count)
+        return 0;
+    
+    wpng_band_job job;
+    memset(&job, 0, sizeof(job));
+    job.buf = buf;
+    job.flags = flags;
+    job.format = format;
+    job.width = header->width;
+    job.height = header->height;
+    job.band_rows = band_rows;
+    job.band_count = band_count;
+    job.band_starts = band_starts;
+    job.image_data = image_data;
+    job.stride = stride;
+    job.out_bpp = out_bpp;
+    job.thread_memory = thread_memory;
+    job.thread_memory_size = thread_memory_size;
+    job.band_ok = band_ok;
+    job.band_adler = band_adler;
+    job.band_size = band_size;
+    job.max_extra_image_data = decoder->limits.max_extra_image_data;
+    wpng_parallel_for(band_count, thread_count, wpng_decode_band, &job);
+    
+    uint8_t ok = 1;
+    uint32_t adler = band_adler[0];
+    for (uint32_t i = 0; i < band_count; i += 1)
+    {
+        ok = ok && band_ok[i];
+        if (i > 0)
+            adler = infl_combine_adler32(adler, band_adler[i], band_size[i]);
+    }
+    if (!(flags & WPNG_READ_SKIP_ADLER32))
+        ok = ok && adler == job.expected_adler;
+    return ok;
+}
+
+typedef struct {
+    const wpng_row_format * format;
+    infl_stream * stream;
+    uint32_t width;
+    uint32_t height;
+    // region and scale, as in wpng_decode_target
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1;
+    uint32_t y1;
+    uint8_t scale;
+    uint8_t last_pass;
+    uint8_t is_packed;
+    uint8_t * image_data;
+    size_t stride;
+    uint8_t out_bpp;
+    // a row of zeroes, then the scanlines (with filter type bytes) of every pass before the last one, one pass after another
+    uint8_t * pass_data;
+    size_t pass_starts[8];
+    uint8_t * rows; // current and previous scanline of the last pass
+    // a row in the png's layout (for convert_row) per thread
+    uint8_t * thread_memory;
+    size_t thread_memory_size;
+    uint8_t error; // as in wpng_decoder_decode
+    uint8_t stopped_early; // the last pass reached y1 before the end of the image
+} wpng_pass_job;
+
+// output rows (at full size) that are filled in together, in one go, by wpng_deinterlace_rows
+#define WPNG_DEINTERLACE_BAND_ROWS 64
+
+// bytes per scanline of an adam7 pass
+static inline size_t wpng_pass_bps(const wpng_row_format * format, uint32_t width, uint8_t pass)
+{
+    return (adam7_pass_size(width, adam7_x_inits[pass], adam7_x_gaps[pass]) * format->bit_depth + 7) / 8 * format->components;
+}
+
+// converts a defiltered scanline of an adam7 pass, which is in row y_out of the image, into the output (if it's inside the region)
+static void wpng_output_pass_row(const wpng_pass_job * job, const uint8_t * scanline, uint8_t pass, size_t y_out, uint8_t * temp_row)
+{
+    uint8_t x_init = adam7_x_inits[pass];
+    uint8_t x_gap = adam7_x_gaps[pass];
+    size_t pass_x0 = job->x0 > x_init ? (job->x0 - x_init + x_gap - 1) / x_gap : 0;
+    size_t pass_x1 = job->x1 > x_init ? (job->x1 - x_init + x_gap - 1) / x_gap : 0;
+    if (y_out < job->y0 || y_out >= job->y1 || pass_x0 >= pass_x1)
+        return;
+    // (with a scale, x0 and y0 are 0, and all of this pass's pixels are on multiples of it)
+    if (job->is_packed)
+        scatter_packed_row(scanline, pass_x1, &job->image_data[(y_out - job->y0) * job->stride], x_init, x_gap, job->format->bit_depth);
+    else
+        convert_row(scanline, pass_x0, pass_x1 - pass_x0, &job->image_data[(y_out - job->y0) / job->scale * job->stride + (pass_x0 * x_gap + x_init - job->x0) / job->scale * job->out_bpp],
+                    x_gap / job->scale * job->out_bpp, job->format, temp_row);
+}
+
+// defilters one of the passes in pass_data, in place; the biggest (latest) passes go first
+static void wpng_defilter_pass(void * userdata, size_t index, uint32_t thread)
+{
+    (void)thread;
+    wpng_pass_job * job = (wpng_pass_job *)userdata;
+    uint8_t pass = job->last_pass - 1 - index;
+    size_t pass_bps = wpng_pass_bps(job->format, job->width, pass);
+    size_t pass_height = pass_bps ? adam7_pass_size(job->height, adam7_y_inits[pass], adam7_y_gaps[pass]) : 0;
+    const uint8_t * prev_row = job->pass_data;
+    for (size_t y = 0; y < pass_height; y += 1)
+    {
+        uint8_t * row = &job->pass_data[job->pass_starts[pass] + y * (pass_bps + 1)];
+        defilter(&row[1], prev_row, pass_bps, row[0], job->format->bpp);
+        prev_row = &row[1];
+    }
+}
+
+// the first index decompresses, defilters and converts the last pass, one scanline at a time, like a serial decode
+// the others each fill in a band of the rows that the last pass doesn't have, from the already defiltered passes before it
+// (the last pass's rows never have pixels from any other pass in them, so no two indices write to the same row)
+static void wpng_deinterlace_rows(void * userdata, size_t index, uint32_t thread)
+{
+    wpng_pass_job * job = (wpng_pass_job *)userdata;
+    uint8_t * temp_row = job->thread_memory ? &job->thread_memory[thread * job->thread_memory_size] : 0;
+    uint8_t last_pass = job->last_pass;
+    
+    if (index == 0)
+    {
+        size_t pass_bps = wpng_pass_bps(job->format, job->width, last_pass);
+        size_t pass_height = pass_bps ? adam7_pass_size(job->height, adam7_y_inits[last_pass], adam7_y_gaps[last_pass]) : 0;
+        uint8_t * row = job->rows;
+        uint8_t * prev_row = &job->rows[pass_bps + 1];
+        memset(prev_row, 0, pass_bps + 1);
+        for (size_t y = 0; y < pass_height; y += 1)
+        {
+            size_t y_out = y * adam7_y_gaps[last_pass] + adam7_y_inits[last_pass];
+            if (y_out >= job->y1)
+            {
+                job->stopped_early = 1;
+                break;
+            }
+            if (infl_stream_read(job->stream, row, pass_bps + 1) != pass_bps + 1 || job->stream->error)
             {
-                WPNG_ASSERT(size == 6, 5);
-                uint16_t val_r = byteswap_int(bytes_pop_int(buf, 2), 2);
-                WPNG_ASSERT(val_r < (1 << bit_depth), 5);
-                uint16_t val_g = byteswap_int(bytes_pop_int(buf, 2), 2);
-                WPNG_ASSERT(val_g < (1 << bit_depth), 5);
-                uint16_t val_b = byteswap_int(bytes_pop_int(buf, 2), 2);
-                WPNG_ASSERT(val_b < (1 << bit_depth), 5);
-                transparent_r = val_r;
-                transparent_g = val_g;
-                transparent_b = val_b;
+                job->error = job->stream->error ? 11 : 2;
+                break;
             }
-            has_trns = 1;
+            defilter(&row[1], &prev_row[1], pass_bps, row[0], job->format->bpp);
+            wpng_output_pass_row(job, &row[1], last_pass, y_out, temp_row);
+            uint8_t * temp = row;
+            row = prev_row;
+            prev_row = temp;
         }
-        else if (memcmp(name, "IEND", 4) == 0)
+        return;
+    }
+    
+    size_t y_start = (index - 1) * WPNG_DEINTERLACE_BAND_ROWS;
+    size_t y_end = y_start + WPNG_DEINTERLACE_BAND_ROWS < job->y1 ? y_start + WPNG_DEINTERLACE_BAND_ROWS : job->y1;
+    for (size_t y_out = y_start > job->y0 ? y_start : job->y0; y_out < y_end; y_out += 1)
+    {
+        for (uint8_t pass = 1; pass < last_pass; pass += 1)
         {
-            has_iend = 1;
-            break;
+            uint8_t y_init = adam7_y_inits[pass];
+            uint8_t y_gap = adam7_y_gaps[pass];
+            size_t pass_bps = wpng_pass_bps(job->format, job->width, pass);
+            if (y_out < y_init || (y_out - y_init) % y_gap != 0 || pass_bps == 0)
+                continue;
+            const uint8_t * row = &job->pass_data[job->pass_starts[pass] + (y_out - y_init) / y_gap * (pass_bps + 1)];
+            wpng_output_pass_row(job, &row[1], pass, y_out, temp_row);
         }
-        else
+    }
+}
+
+// decodes the adam7 passes of an interlaced png on up to thread_count threads
+// every pass before the last one is decompressed up front and defiltered (a pass per thread), then the rows of the output that they make up are
+//  filled in a band at a time, while the last pass, which is about half of the image data, is decompressed and converted at the same time
+// (filling in whole rows, rather than a pass at a time, keeps threads from writing to the same rows, and each row gets written in one go)
+// returns zero if there isn't enough memory for it, in which case nothing has been read from the stream yet
+static uint8_t wpng_decode_passes(wpng_decoder * decoder, wpng_pass_job * job, uint32_t thread_count)
+{
+    const wpng_row_format * format = job->format;
+    size_t max_bps = ((size_t)job->width * format->bit_depth + 7) / 8 * format->components;
+    size_t size = max_bps;
+    for (uint8_t pass = 1; pass < job->last_pass; pass += 1)
+    {
+        size_t pass_bps = wpng_pass_bps(format, job->width, pass);
+        job->pass_starts[pass] = size;
+        if (pass_bps != 0)
+            size += (pass_bps + 1) * adam7_pass_size(job->height, adam7_y_inits[pass], adam7_y_gaps[pass]);
+    }
+    
+    size_t temp_row_size = format->pixel_format != WPNG_FORMAT_PNG && !wpng_is_index_format(format->pixel_format) ? (size_t)job->width * format->out_bpp : 0;
+    job->thread_memory_size = (temp_row_size + 15) / 16 * 16;
+    job->thread_memory = job->thread_memory_size ? (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_PASS_THREADS, job->thread_memory_size * thread_count) : 0;
+    job->pass_data = (uint8_t *)wpng_alloc(decoder, size);
+    if ((job->thread_memory_size && !job->thread_memory) || !job->pass_data)
+    {
+        if (job->pass_data)
+            wpng_free(decoder, job->pass_data);
+        return 0;
+    }
+    memset(job->pass_data, 0, max_bps);
+    
+    if (infl_stream_read(job->stream, &job->pass_data[max_bps], size - max_bps) != size - max_bps || job->stream->error)
+        job->error = job->stream->error ? 11 : 2;
+    else
+    {
+        wpng_parallel_for(job->last_pass - 1, thread_count, wpng_defilter_pass, job);
+        wpng_parallel_for(1 + (job->y1 + WPNG_DEINTERLACE_BAND_ROWS - 1) / WPNG_DEINTERLACE_BAND_ROWS, thread_count, wpng_deinterlace_rows, job);
+    }
+    wpng_free(decoder, job->pass_data);
+    return 1;
+}
+
+// whether a stream that broke did so because its input ran out, rather than because it's invalid
+// (data cut off partway through a huffman code or block header can look invalid before it's found to be missing)
+static inline uint8_t wpng_stream_ran_out(const infl_stream * stream)
+{
+    return stream->input.overrun || (!stream->input.next_segment && stream->input.pos >= stream->input.end);
+}
+
+// size of the block of pixels that each pixel decoded so far stands for after each adam7 pass, until the later passes fill it in
+static const uint8_t adam7_fill_widths[] = {1, 8, 4, 4, 2, 2, 1, 1};
+static const uint8_t adam7_fill_heights[] = {1, 8, 8, 4, 4, 2, 2, 1};
+
+// after adam7 pass `pass`, copies each pixel that's been decoded over the rest of its block, so that the image looks like a blocky version of itself instead of being full of holes
+// (the passes after it overwrite all of the copies)
+static void wpng_adam7_fill(uint8_t * image_data, size_t stride, uint32_t width, uint32_t height, uint8_t bpp, uint8_t pass)
+{
+    uint8_t block_width = adam7_fill_widths[pass];
+    uint8_t block_height = adam7_fill_heights[pass];
+    for (size_t y = 0; y < height; y += 1)
+    {
+        uint8_t * row = &image_data[y * stride];
+        if (y % block_height != 0)
+            memcpy(row, &image_data[(y - y % block_height) * stride], (size_t)width * bpp);
+        else if (block_width > 1)
         {
-            if (!(flags & WPNG_READ_SKIP_CRITICAL_CHUNKS))
-                WPNG_ASSERT(!critical, 7); // unknown chunks must not be critical
+            for (size_t x = 0; x < width; x += 1)
+            {
+                if (x % block_width != 0)
+                    memcpy(&row[x * bpp], &row[(x - x % block_width) * bpp], bpp);
+            }
         }
-        
-        prev_was_idat = (memcmp(name, "IDAT", 4) == 0);
-        
-        WPNG_ASSERT(width != 0 && height != 0, 8); // header must exist and give valid width/height values
-        
-        buf->cur = cur_start + size + 4;
     }
-    uint8_t was_16bit = bit_depth == 16;
+}
+
+// calls the decoder's progress callback; returns nonzero if it asked to stop
+static uint8_t wpng_report_progress(wpng_decoder * decoder, const uint8_t * image_data, size_t stride, uint32_t width, uint32_t height, uint32_t rows, uint8_t pass, uint8_t is_filled)
+{
+    wpng_progress progress;
+    progress.data = image_data;
+    progress.bytes_per_scanline = stride;
+    progress.width = width;
+    progress.height = height;
+    progress.rows = rows;
+    progress.pass = pass;
+    progress.is_filled = is_filled;
+    return decoder->progress_callback(decoder->progress_userdata, &progress);
+}
+
+// what wpng_decode decodes, and where to; all zeroes means the whole image, into a new allocation
+typedef struct {
+    uint8_t * dest; // if null, a new buffer is allocated, and the rest of the dest_ values are ignored
+    size_t dest_size;
+    size_t dest_stride;
+    uint32_t x_offset;
+    uint32_t y_offset;
+    // region of the image to decode: columns [x0, x1) and rows [y0, y1)
+    // x1 and y1 of 0 mean the right and bottom edges
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1;
+    uint32_t y1;
+    uint8_t scale; // 2, 4 or 8 to decode at 1/scale the size (whole image only); 0 or 1 for full size
+} wpng_decode_target;
+
+// see wpng_load, wpng_load_into, wpng_load_region and wpng_load_scaled
+// all memory is allocated through the decoder, and all of it but the output image is kept in its scratch buffers
+static void wpng_decoder_decode(wpng_decoder * decoder, byte_buffer * buf, uint32_t flags, const wpng_decode_target * target, wpng_load_output * output)
+{
+    assert(decoder);
+    assert(output);
+    assert(buf);
+    assert(buf->data);
+    assert(target);
     
-    WPNG_ASSERT(has_idat, 8);
-    WPNG_ASSERT(has_iend, 8);
-    WPNG_ASSERT(width != 0 && height != 0, 8); // header must exist
+    wpng_header header;
+    wpng_read_chunks(buf, flags, 0, &decoder->limits, decoder->chunk_callback, decoder->chunk_userdata, &header);
+    WPNG_ASSERT(!header.error, header.error);
+    const wpng_limits * limits = &decoder->limits;
     
-    if (color_type == 4 || color_type == 6)
-        WPNG_ASSERT(has_trns == 0, 9);
-    if (color_type == 0 || color_type == 4)
-        WPNG_ASSERT(palette_size == 0, 9);
-    if (color_type == 3)
-        WPNG_ASSERT(palette_size != 0, 10);
+    uint32_t width = header.width;
+    uint32_t height = header.height;
+    
+    uint32_t x0 = target->x0;
+    uint32_t y0 = target->y0;
+    uint32_t x1 = target->x1 ? target->x1 : width;
+    uint32_t y1 = target->y1 ? target->y1 : height;
+    WPNG_ASSERT(x0 < x1 && x1 <= width && y0 < y1 && y1 <= height, 13);
+    uint8_t scale = target->scale ? target->scale : 1;
+    WPNG_ASSERT(scale == 1 || scale == 2 || scale == 4 || scale == 8, 13);
+    WPNG_ASSERT(scale == 1 || (x0 == 0 && y0 == 0 && x1 == width && y1 == height), 13);
+    uint8_t pixel_format = wpng_read_format(flags);
+    WPNG_ASSERT(wpng_format_supported(&header, flags), 14);
+    // indices can't be averaged, and packed rows can't start partway into a byte
+    uint8_t is_index_format = wpng_is_index_format(pixel_format);
+    uint8_t is_packed = pixel_format == WPNG_FORMAT_INDEX_PACKED;
+    WPNG_ASSERT(!is_index_format || scale == 1, 13);
+    WPNG_ASSERT(!is_packed || (x0 == 0 && x1 == width && (!target->dest || target->x_offset == 0)), 13);
+    // the 8-bit pixel formats are converted to from 8-bit Y/YA/RGB/RGBA
+    if (pixel_format != WPNG_FORMAT_PNG && wpng_format_bpp[pixel_format] <= 4)
+        flags |= WPNG_READ_FORCE_8BIT;
+    // size of the output image
+    uint32_t out_width = (x1 - x0 + scale - 1) / scale;
+    uint32_t out_height = (y1 - y0 + scale - 1) / scale;
+    uint8_t * dest = target->dest;
+    uint8_t bit_depth = header.bit_depth;
+    uint8_t color_type = header.color_type;
+    uint8_t interlacing = header.interlacing;
+    uint8_t has_trns = header.has_trns;
+    uint8_t is_srgb = header.is_srgb;
+    float gamma = header.gamma;
+    uint8_t * palette = header.palette;
+    
+    uint8_t was_16bit = bit_depth == 16;
     
     uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
     uint8_t components = temp[color_type];
     
     uint8_t bpp = components * ((bit_depth + 7) / 8);
-    size_t bytes_per_scanline = width * bpp;
     
-    idat.cur = 0;
-    int error = 0;
-    byte_buffer dec = do_inflate(&idat, &error, 1); // decompresses into `dec` (declared earlier)
-    free(idat.data);
-    dec.cur = 0;
-    WPNG_ASSERT(error == 0, 11);
+    // convert to Y/YA/RGB/RGBA if needed, and then to the pixel format if there is one
     
-    uint8_t * image_data = (uint8_t *)malloc(height * bytes_per_scanline);
-    WPNG_ASSERT(image_data, 100);
-    memset(image_data, 0, height * bytes_per_scanline);
+    uint8_t out_bpp = wpng_output_bpp(&header, flags);
+    uint8_t layout_bpp = wpng_output_bpp(&header, flags & ~WPNG_READ_FORMAT_MASK);
     
-    uint8_t defilter_error = 0;
-    if (!interlacing)
+    wpng_row_format format;
+    memset(&format, 0, sizeof(format));
+    format.color_type = color_type;
+    format.bit_depth = bit_depth;
+    format.components = components;
+    format.bpp = bpp;
+    format.out_bpp = layout_bpp;
+    format.has_trns = has_trns;
+    format.force_8bit = !!(flags & WPNG_READ_FORCE_8BIT);
+    format.transparent_r = header.transparent_r;
+    format.transparent_g = header.transparent_g;
+    format.transparent_b = header.transparent_b;
+    format.palette = palette;
+    // needed if any one of the following is true:
+    // - image is indexed
+    // - image has an alpha override (trns chunk) (whether indexed or cutoff)
+    // - image is 1, 2, or 4 bits per channel (e.g. grayscale)
+    // - image is 16 bits per pixel and WPNG_READ_FORCE_8BIT is enabled
+    format.needs_conversion = color_type == 3 || has_trns || bit_depth < 8 || layout_bpp != bpp;
+    format.is_raw = (pixel_format == WPNG_FORMAT_PNG && !format.needs_conversion) || is_packed || (pixel_format == WPNG_FORMAT_INDEX8 && bit_depth == 8);
+    // gray images of up to 8 bits go through a palette too (there can't be a PLTE chunk to clash with)
+    if (color_type == 0 && bit_depth <= 8)
     {
-        defilter(image_data, height * bytes_per_scanline, &dec, width, height, 0, bit_depth, components, &defilter_error);
-        WPNG_ASSERT(defilter_error == 0, defilter_error);
+        for (uint32_t val = 0; val < (1u << bit_depth); val += 1)
+        {
+            palette[val * 4 + 0] = val * (0xFF / ((1 << bit_depth) - 1));
+            palette[val * 4 + 1] = val == header.transparent_r ? 0 : 0xFF;
+        }
     }
-    else
+    
+    if (is_srgb || (flags & WPNG_READ_SKIP_GAMMA_CORRECTION))
+        gamma = -1.0;
+    
+    format.pixel_format = pixel_format;
+    format.gamma = gamma;
+    if (pixel_format != WPNG_FORMAT_PNG)
     {
-        for (uint8_t i = 1; i <= 7; i += 1)
+        const uint8_t * gamma_table = gamma >= 0.0 ? get_gamma_table_u8(gamma) : 0;
+        for (uint32_t val = 0; val < 256; val += 1)
+            format.gamma_u8[val] = gamma_table ? gamma_table[val] : val;
+        if (pixel_format == WPNG_FORMAT_RGBA32F)
+        {
+            for (uint32_t val = 0; val < 256; val += 1)
+                format.linear_u8[val] = to_linear(val / 255.0, gamma);
+        }
+        
+        // like with apply_gamma, a full 16-bit table is only worth building if the image has more samples than it has entries
+        if (bit_depth == 16 && !format.force_8bit && (size_t)out_width * out_height * 3 > 65536)
+        {
+            if (pixel_format == WPNG_FORMAT_RGBA32F)
+            {
+                float * table = (float *)wpng_scratch(decoder, WPNG_SCRATCH_GAMMA, 65536 * sizeof(float));
+                for (uint32_t val = 0; table && val < 65536; val += 1)
+                    table[val] = to_linear(val / 65535.0, gamma);
+                format.linear_u16 = table;
+            }
+            else if (gamma >= 0.0)
+            {
+                uint16_t * table = (uint16_t *)wpng_scratch(decoder, WPNG_SCRATCH_GAMMA, 65536 * sizeof(uint16_t));
+                for (uint32_t val = 0; table && val < 65536; val += 1)
+                    table[val] = apply_gamma_u16(val, gamma);
+                format.gamma_u16 = table;
+            }
+        }
+        
+        if (is_index_format)
+        {
+            for (uint32_t i = 0; i < 256; i += 1)
+                format.format_palette_data[i * 4] = i;
+            format.format_palette = format.format_palette_data;
+        }
+        else if (wpng_format_bpp[pixel_format] <= 4 && convert_uses_palette(&format))
         {
-            defilter(image_data, height * bytes_per_scanline, &dec, width, height, i, bit_depth, components, &defilter_error);
-            WPNG_ASSERT(defilter_error == 0, defilter_error);
+            for (uint32_t i = 0; i < 256; i += 1)
+                format_pixels(&palette[i * 4], 1, &format.format_palette_data[i * 4], 4, &format);
+            format.format_palette = format.format_palette_data;
         }
     }
     
-    // convert to Y/YA/RGB/RGBA if needed
+    size_t bytes_per_scanline = wpng_output_row_size(&header, flags, out_width);
+    if (bit_depth == 16 && (flags & WPNG_READ_FORCE_8BIT))
+        bit_depth = 8;
     
-    uint8_t out_bpp = components + has_trns;
-    if (color_type == 3)
-        out_bpp = 3 + has_trns;
-    if (bit_depth == 16 && !(flags & WPNG_READ_FORCE_8BIT))
-        out_bpp *= 2;
+    WPNG_ASSERT(!limits->max_decoded_bytes || (uint64_t)bytes_per_scanline * out_height <= limits->max_decoded_bytes, 18);
+    // deflate can't output more than 258 bytes (a match) for every 2 bits of input, so an image that claims more data than that can't be decoded,
+    //  and doesn't need to be allocated to find out (unless only its top part is decoded)
+    uint64_t image_data_size = wpng_image_data_size(&header);
+    uint8_t is_partial_input = !!(flags & WPNG_READ_PARTIAL);
+    if (y1 == height && (!interlacing || scale == 1) && !is_partial_input)
+        WPNG_ASSERT(image_data_size <= header.idat_total * 1032, 21);
     
-    // runs if any one of the following is true:
-    // - image is indexed
-    // - image has an alpha override (trns chunk) (whether indexed or cutoff)
-    // - image is 1, 2, or 4 bits per channel (e.g. grayscale)
-    // - image is 16 bits per pixel and WPNG_READ_FORCE_8BIT is enabled
-    if (color_type == 3 || has_trns || bit_depth < 8 || out_bpp != bpp)
+    // distance between the starts of two rows of image_data
+    size_t stride = bytes_per_scanline;
+    uint8_t * image_data = 0;
+    if (dest)
+    {
+        // (packed rows are sized as if they had a byte per pixel; x_offset is 0 for them)
+        size_t dest_needed = is_packed ? wpng_dest_size(bytes_per_scanline, out_height, 1, target->dest_stride, 0, target->y_offset)
+                                       : wpng_dest_size(out_width, out_height, out_bpp, target->dest_stride, target->x_offset, target->y_offset);
+        WPNG_ASSERT(dest_needed != 0 && dest_needed <= target->dest_size, 12);
+        stride = target->dest_stride;
+        image_data = &dest[(size_t)target->y_offset * stride + (size_t)target->x_offset * out_bpp];
+    }
+    else
+    {
+        image_data = (uint8_t *)wpng_alloc(decoder, out_height * bytes_per_scanline);
+        WPNG_ASSERT(image_data, 100);
+        memset(image_data, 0, out_height * bytes_per_scanline);
+    }
+    
+    // pngs with a band index can have their bands decoded on several threads at once; if that doesn't work out, they're decoded serially below
+    uint8_t decoded_bands = 0;
+    if (header.band_count > 1 && !interlacing && x0 == 0 && y0 == 0 && x1 == width && y1 == height && scale == 1 && !(flags & WPNG_READ_NO_THREADS) && !is_partial_input && !decoder->progress_callback)
     {
-        uint8_t * out_image_data = (uint8_t *)malloc(height * width * out_bpp);
-        WPNG_ASSERT(out_image_data, 100);
-        memset(out_image_data, 0, height * width * out_bpp);
+        uint32_t thread_count = wpng_thread_count();
+        if (thread_count > 1)
+            decoded_bands = wpng_decode_bands(decoder, buf, flags, &header, &format, image_data, stride, out_bpp, thread_count);
+    }
+    
+    // scanlines are decompressed, defiltered, and converted one at a time, straight into image_data
+    // `rows` holds the current and previous scanline (with filter type byte) of the current pass
+    size_t max_bps = ((size_t)width * format.bit_depth + 7) / 8 * components;
+    uint8_t * rows = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_ROWS, (max_bps + 1) * 2);
+    
+    // after these adam7 passes, an interlaced image has every scale'th pixel of every scale'th row
+    uint8_t last_pass = !interlacing ? 0 : scale == 8 ? 1 : scale == 4 ? 3 : scale == 2 ? 5 : 7;
+    // non-interlaced images get downscaled with a box filter instead: each full size row is converted into wide_row,
+    // then added into box_sums (one sum per output sample) until scale rows have been added up
+    uint8_t is_box_filtered = !interlacing && scale > 1;
+    uint8_t * wide_row = 0;
+    uint32_t * box_sums = 0;
+    if (is_box_filtered)
+    {
+        wide_row = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_WIDE_ROW, (size_t)width * layout_bpp);
+        box_sums = (uint32_t *)wpng_scratch(decoder, WPNG_SCRATCH_BOX_SUMS, (size_t)out_width * layout_bpp * sizeof(uint32_t));
+        if (box_sums)
+            memset(box_sums, 0, (size_t)out_width * layout_bpp * sizeof(uint32_t));
+    }
+    // a row in the png's layout, for converting to the pixel format
+    uint8_t * temp_row = 0;
+    if (pixel_format != WPNG_FORMAT_PNG && !is_index_format)
+        temp_row = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_FORMAT_ROW, (size_t)width * layout_bpp);
+    
+    uint8_t * stream_memory = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_INFLATE, INFL_STREAM_MEMORY_SIZE);
+    if (!rows || !stream_memory || (is_box_filtered && (!wide_row || !box_sums)) || (pixel_format != WPNG_FORMAT_PNG && !is_index_format && !temp_row))
+    {
+        if (!dest)
+            wpng_free(decoder, image_data);
+        WPNG_ASSERT(0, 100);
+    }
+    infl_stream stream;
+    infl_stream_init_with(&stream, buf->data, header.idat_start, header.idat_start + header.idat_size, wpng_next_idat, buf, (flags & WPNG_READ_SKIP_ADLER32) ? 10 : 1, stream_memory);
+    
+    uint8_t decode_error = 0;
+    // set if the rest of the image data isn't needed for the region or scale, so it doesn't get read
+    uint8_t stopped_early = last_pass < (interlacing ? 7 : 0);
+    // set if the data ran out (with WPNG_READ_PARTIAL) or the progress callback asked to stop before the image was finished
+    uint8_t is_partial = 0;
+    // progressive decoding: rows of a non-interlaced image that have been finished, and reported to the callback
+    uint32_t rows_done = 0;
+    uint32_t rows_reported = 0;
+    uint8_t can_fill = decoder->progress_fill && x0 == 0 && y0 == 0 && scale == 1 && !is_packed;
+    
+    // with threads, interlaced images have their passes decoded at the same time instead (unless they have to be decoded a pass at a time, for progress callbacks or partial data)
+    uint8_t decoded_passes = 0;
+    uint32_t pass_threads = interlacing && last_pass > 1 && !(flags & WPNG_READ_NO_THREADS) && !is_partial_input && !decoder->progress_callback ? wpng_thread_count() : 1;
+    if (pass_threads > 1)
+    {
+        wpng_pass_job job;
+        memset(&job, 0, sizeof(job));
+        job.format = &format;
+        job.stream = &stream;
+        job.width = width;
+        job.height = height;
+        job.x0 = x0;
+        job.y0 = y0;
+        job.x1 = x1;
+        job.y1 = y1;
+        job.scale = scale;
+        job.last_pass = last_pass;
+        job.is_packed = is_packed;
+        job.image_data = image_data;
+        job.stride = stride;
+        job.out_bpp = out_bpp;
+        job.rows = rows;
+        decoded_passes = wpng_decode_passes(decoder, &job, pass_threads);
+        decode_error = job.error;
+        stopped_early = stopped_early || job.stopped_early;
+    }
+    for (uint8_t pass = interlacing ? 1 : 0; pass <= last_pass && !decode_error && !decoded_bands && !decoded_passes && !is_partial; pass += 1)
+    {
+        uint8_t x_init = adam7_x_inits[pass];
+        uint8_t x_gap = adam7_x_gaps[pass];
+        size_t pass_width = adam7_pass_size(width, x_init, x_gap);
+        size_t pass_height = adam7_pass_size(height, adam7_y_inits[pass], adam7_y_gaps[pass]);
+        // note: bit_depth can only be less than 8 if there is only one component
+        size_t pass_bps = (pass_width * format.bit_depth + 7) / 8 * components;
+        // (passes with no columns have no scanlines at all, not even filter type bytes)
+        if (pass_bps == 0)
+            pass_height = 0;
+        
+        // the pass's columns [pass_x0, pass_x1) are the ones inside the region
+        size_t pass_x0 = x0 > x_init ? (x0 - x_init + x_gap - 1) / x_gap : 0;
+        size_t pass_x1 = x1 > x_init ? (x1 - x_init + x_gap - 1) / x_gap : 0;
+        uint8_t is_last_pass = pass == last_pass;
+        // scanlines that are already in the output format can be inflated and defiltered right where they go
+        // (unless the data might run out partway through one)
+        uint8_t is_direct = pass == 0 && format.is_raw && x0 == 0 && x1 == width && scale == 1 && !is_partial_input;
         
-        if (color_type == 3)
+        uint8_t * row = rows;
+        uint8_t * prev_row = &rows[max_bps + 1];
+        memset(prev_row, 0, pass_bps + 1);
+        for (size_t y = 0; y < pass_height; y += 1)
         {
-            for (size_t y = 0; y < height; y += 1)
+            size_t y_out = y * adam7_y_gaps[pass] + adam7_y_inits[pass];
+            if (is_last_pass && y_out >= y1)
+            {
+                stopped_early = 1;
+                break;
+            }
+            // (with a scale, x0 and y0 are 0, and all of this pass's pixels are on multiples of it)
+            uint8_t * out = 0;
+            if (y_out >= y0 && y_out < y1 && pass_x0 < pass_x1 && !is_box_filtered)
+                out = &image_data[(y_out - y0) / scale * stride + (pass_x0 * x_gap + x_init - x0) / scale * out_bpp];
+            
+            if (out && is_direct)
             {
-                for (size_t x = 0; x < width; x += 1)
+                if (infl_stream_read(&stream, row, 1) != 1 || infl_stream_read(&stream, out, pass_bps) != pass_bps)
                 {
-                    uint8_t val = image_data[y * bytes_per_scanline + x];
-                    out_image_data[(y * width + x) * out_bpp + 0] = palette[val * 4 + 0];
-                    out_image_data[(y * width + x) * out_bpp + 1] = palette[val * 4 + 1];
-                    out_image_data[(y * width + x) * out_bpp + 2] = palette[val * 4 + 2];
-                    out_image_data[(y * width + x) * out_bpp + 3] = palette[val * 4 + 3];
+                    decode_error = stream.error ? 11 : 2;
+                    break;
                 }
+                // rows above the region are in prev_row instead
+                defilter(out, y_out > y0 ? out - stride : &prev_row[1], pass_bps, row[0], bpp);
+                rows_done = y_out - y0 + 1;
             }
-        }
-        else if (components == 1)
-        {
-            for (size_t y = 0; y < height; y += 1)
+            else
             {
-                for (size_t x = 0; x < width; x += 1)
+                // (a row can come out whole even if the stream broke on its last byte)
+                if (infl_stream_read(&stream, row, pass_bps + 1) != pass_bps + 1 || stream.error)
                 {
-                    if (bit_depth == 16)
-                    {
-                        size_t i = y * bytes_per_scanline;
-                        uint16_t val = ((uint16_t)image_data[i + x * 2] << 8) | image_data[i + x * 2 + 1];
-                        
-                        if (flags & WPNG_READ_FORCE_8BIT)
-                        {
-                            out_image_data[(y * width + x) * out_bpp + 0] = u16_to_u8(val);
-                            if (has_trns)
-                                out_image_data[(y * width + x) * out_bpp + 1] = val == transparent_r ? 0 : 0xFF;
-                        }
-                        else
-                        {
-                            out_image_data[(y * width + x) * out_bpp + 0] = val >> 8;
-                            out_image_data[(y * width + x) * out_bpp + 1] = val & 0xFF;
-                            if (has_trns)
-                            {
-                                out_image_data[(y * width + x) * out_bpp + 2] = val == transparent_r ? 0 : 0xFF;
-                                out_image_data[(y * width + x) * out_bpp + 3] = val == transparent_r ? 0 : 0xFF;
-                            }
-                        }
-                    }
+                    if (is_partial_input && wpng_stream_ran_out(&stream))
+                        is_partial = 1;
                     else
+                        decode_error = stream.error ? 11 : 2;
+                    break;
+                }
+                defilter(&row[1], &prev_row[1], pass_bps, row[0], bpp);
+                if (out && is_packed)
+                    scatter_packed_row(&row[1], pass_width, &image_data[(y_out - y0) * stride], x_init, x_gap, format.bit_depth);
+                else if (out)
+                    convert_row(&row[1], pass_x0, pass_x1 - pass_x0, out, x_gap / scale * out_bpp, &format, temp_row);
+                if (is_box_filtered)
+                {
+                    convert_row_native(&row[1], 0, width, wide_row, layout_bpp, &format);
+                    box_add_row(wide_row, width, scale, layout_bpp, bit_depth == 16, box_sums);
+                    if ((y + 1) % scale == 0 || y + 1 == height)
                     {
-                        uint8_t val = image_data[y * bytes_per_scanline + x];
-                        
-                        if (has_trns)
-                            out_image_data[(y * width + x) * out_bpp + 1] = val == transparent_r ? 0 : 0xFF;
-                        
-                        if (bit_depth == 1)
-                            val *= 0xFF;
-                        else if (bit_depth == 2)
-                            val *= 0x55;
-                        else if (bit_depth == 4)
-                            val *= 0x11;
-                        
-                        out_image_data[(y * width + x) * out_bpp] = val;
+                        uint8_t * box_out = &image_data[y / scale * stride];
+                        box_resolve_row(box_sums, width, scale, y % scale + 1, layout_bpp, bit_depth == 16, pixel_format != WPNG_FORMAT_PNG ? temp_row : box_out);
+                        if (pixel_format != WPNG_FORMAT_PNG)
+                            format_pixels(temp_row, out_width, box_out, out_bpp, &format);
+                        rows_done = y / scale + 1;
                     }
                 }
+                else if (!interlacing && y_out >= y0)
+                    rows_done = y_out - y0 + 1;
+                
+                uint8_t * temp = row;
+                row = prev_row;
+                prev_row = temp;
             }
-            if (bit_depth == 16 && (flags & WPNG_READ_FORCE_8BIT))
-                bit_depth = 8;
-        }
-        else if (components == 3)
-        {
-            for (size_t y = 0; y < height; y += 1)
+            
+            if (decoder->progress_callback && !interlacing && rows_done > rows_reported
+                && (rows_done - rows_reported >= decoder->progress_rows || rows_done == out_height))
             {
-                for (size_t x = 0; x < width; x += 1)
+                rows_reported = rows_done;
+                if (wpng_report_progress(decoder, image_data, stride, out_width, out_height, rows_done, 0, 0))
                 {
-                    size_t i = y * bytes_per_scanline;
-                    if (bit_depth == 16)
-                    {
-                        uint16_t val_r = ((uint16_t)image_data[i + x * 6 + 0] << 8) | image_data[i + x * 6 + 1];
-                        uint16_t val_g = ((uint16_t)image_data[i + x * 6 + 2] << 8) | image_data[i + x * 6 + 3];
-                        uint16_t val_b = ((uint16_t)image_data[i + x * 6 + 4] << 8) | image_data[i + x * 6 + 5];
-                        
-                        uint8_t is_transparent = (val_r == transparent_r && val_g == transparent_g && val_b == transparent_b);
-                        
-                        if (flags & WPNG_READ_FORCE_8BIT)
-                        {
-                            out_image_data[(y * width + x) * out_bpp + 0] = u16_to_u8(val_r);
-                            out_image_data[(y * width + x) * out_bpp + 1] = u16_to_u8(val_g);
-                            out_image_data[(y * width + x) * out_bpp + 2] = u16_to_u8(val_b);
-                            if (has_trns)
-                                out_image_data[(y * width + x) * out_bpp + 3] = is_transparent ? 0 : 0xFF;
-                        }
-                        else
-                        {
-                            out_image_data[(y * width + x) * out_bpp + 0] = val_r >> 8;
-                            out_image_data[(y * width + x) * out_bpp + 1] = val_r & 0xFF;
-                            out_image_data[(y * width + x) * out_bpp + 2] = val_g >> 8;
-                            out_image_data[(y * width + x) * out_bpp + 3] = val_g & 0xFF;
-                            out_image_data[(y * width + x) * out_bpp + 4] = val_b >> 8;
-                            out_image_data[(y * width + x) * out_bpp + 5] = val_b & 0xFF;
-                            if (has_trns)
-                            {
-                                out_image_data[(y * width + x) * out_bpp + 6] = is_transparent ? 0 : 0xFF;
-                                out_image_data[(y * width + x) * out_bpp + 7] = is_transparent ? 0 : 0xFF;
-                            }
-                        }
-                    }
-                    else
-                    {
-                        uint8_t val_r = image_data[i + x * 3 + 0];
-                        uint8_t val_g = image_data[i + x * 3 + 1];
-                        uint8_t val_b = image_data[i + x * 3 + 2];
-                        
-                        uint8_t is_transparent = (val_r == transparent_r && val_g == transparent_g && val_b == transparent_b);
-                        
-                        out_image_data[(y * width + x) * out_bpp + 0] = val_r;
-                        out_image_data[(y * width + x) * out_bpp + 1] = val_g;
-                        out_image_data[(y * width + x) * out_bpp + 2] = val_b;
-                        if (has_trns)
-                            out_image_data[(y * width + x) * out_bpp + 3] = is_transparent ? 0 : 0xFF;
-                    }
+                    is_partial = rows_done < out_height;
+                    stopped_early = 1;
+                    break;
                 }
             }
-            if (bit_depth == 16 && (flags & WPNG_READ_FORCE_8BIT))
-                bit_depth = 8;
         }
-        else // components == 2 or 4
+        
+        if (decoder->progress_callback && interlacing && !decode_error && !is_partial)
         {
-            assert(bit_depth == 16 && (flags & WPNG_READ_FORCE_8BIT));
-            for (size_t y = 0; y < height; y += 1)
+            if (can_fill && !is_last_pass)
+                wpng_adam7_fill(image_data, stride, out_width, out_height, out_bpp, pass);
+            if (wpng_report_progress(decoder, image_data, stride, out_width, out_height, is_last_pass ? out_height : 0, pass, can_fill && !is_last_pass))
             {
-                for (size_t x = 0; x < width * components; x += 1)
-                {
-                    size_t i = y * bytes_per_scanline;
-                    uint16_t val = ((uint16_t)image_data[i + x * 2 + 0] << 8) | image_data[i + x * 2 + 1];
-                    out_image_data[(y * width) * out_bpp + x] = u16_to_u8(val);
-                }
+                is_partial = !is_last_pass;
+                stopped_early = 1;
             }
-            bit_depth = 8;
         }
-        
-        free(image_data);
-        bpp = out_bpp;
-        image_data = out_image_data;
-        bytes_per_scanline = width * out_bpp;
     }
-    if (is_srgb || (flags & WPNG_READ_SKIP_GAMMA_CORRECTION))
-        gamma = -1.0;
-    
-    if (gamma >= 0.0)
-        apply_gamma(width, height, bpp, bit_depth == 16, image_data, bytes_per_scanline, gamma);
+    // whatever was decoded before the data ran out gets reported too
+    if (decoder->progress_callback && is_partial && !stopped_early && !interlacing && rows_done > rows_reported)
+        wpng_report_progress(decoder, image_data, stride, out_width, out_height, rows_done, 0, 0);
+    // the zlib checksum comes after any leftover data, of which there can't be too much
+    while (!decode_error && !stopped_early && !is_partial && !decoded_bands && stream.state != INFL_STATE_DONE)
+    {
+        infl_stream_read(&stream, rows, max_bps + 1);
+        if (stream.error && is_partial_input && wpng_stream_ran_out(&stream))
+            break;
+        if (stream.error)
+            decode_error = 11;
+        else if (limits->max_extra_image_data && stream.total_out - image_data_size > limits->max_extra_image_data)
+            decode_error = 21;
+    }
+    if (decode_error)
+    {
+        if (!dest)
+            wpng_free(decoder, image_data);
+        WPNG_ASSERT(0, decode_error);
+    }
+    bpp = out_bpp;
     
-    if (dec.data)
-        free(dec.data);
+    // (pixel formats have had it done already, as they were converted to)
+    if (gamma >= 0.0 && pixel_format == WPNG_FORMAT_PNG)
+    {
+        // a full table is only worth building if the image has more samples than it has entries
+        uint16_t * table_16 = 0;
+        if (bit_depth == 16 && (size_t)out_width * out_height * (bpp / 2) > 65536)
+            table_16 = (uint16_t *)wpng_scratch(decoder, WPNG_SCRATCH_GAMMA, 65536 * sizeof(uint16_t));
+        apply_gamma(out_width, out_height, bpp, bit_depth == 16, image_data, stride, gamma, table_16);
+    }
     
     output->error = 0;
+    output->is_partial = is_partial;
     
     output->data = image_data;
-    output->size = bytes_per_scanline * height;
-    output->bytes_per_scanline = bytes_per_scanline;
-    output->width = width;
-    output->height = height;
+    output->size = stride * (out_height - 1) + bytes_per_scanline;
+    output->bytes_per_scanline = stride;
+    output->width = out_width;
+    output->height = out_height;
     output->gamma = gamma;
     output->bytes_per_pixel = bpp;
-    output->is_16bit = bit_depth == 16;
+    output->is_16bit = wpng_output_is_16bit(&header, flags);
     output->was_16bit = was_16bit;
     output->was_srgb = is_srgb;
+    output->palette_size = 0;
+    if (is_index_format)
+        output->palette_size = wpng_index_palette(&header, gamma, output->palette);
+}
+
+// decodes with a decoder that only lives for this one call, using malloc and free
+static void wpng_decode(byte_buffer * buf, uint32_t flags, const wpng_decode_target * target, wpng_load_output * output)
+{
+    wpng_decoder decoder;
+    wpng_decoder_init(&decoder, 0);
+    wpng_decoder_decode(&decoder, buf, flags, target, output);
+    wpng_decoder_free(&decoder);
+}
+
+// on error, writes nonzero to the "error" value of output and leaves the rest untouched
+// on success, writes zero to the "error" value of output and writes every other value
+static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    wpng_decode(buf, flags, &target, output);
+}
+
+// like wpng_load, but calls callback(userdata, chunk) for each chunk as it's read, which can stop decoding early (see wpng_chunk_func)
+// with a decoder, set decoder.chunk_callback instead
+static inline void wpng_load_with_callback(byte_buffer * buf, uint32_t flags, wpng_chunk_func callback, void * userdata, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    wpng_decoder decoder;
+    wpng_decoder_init(&decoder, 0);
+    decoder.chunk_callback = callback;
+    decoder.chunk_userdata = userdata;
+    wpng_decoder_decode(&decoder, buf, flags, &target, output);
+    wpng_decoder_free(&decoder);
+}
+
+// like wpng_load, but calls callback(userdata, progress) as the image is decoded: after each adam7 pass of interlaced images (with the pixels of
+//  later passes filled in if fill is nonzero), and every `rows` rows of other images; see wpng_progress_func
+// with a decoder, set decoder.progress_callback etc. instead
+static inline void wpng_load_progressive(byte_buffer * buf, uint32_t flags, uint32_t rows, uint8_t fill, wpng_progress_func callback, void * userdata, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    wpng_decoder decoder;
+    wpng_decoder_init(&decoder, 0);
+    decoder.progress_callback = callback;
+    decoder.progress_userdata = userdata;
+    decoder.progress_rows = rows;
+    decoder.progress_fill = fill;
+    wpng_decoder_decode(&decoder, buf, flags, &target, output);
+    wpng_decoder_free(&decoder);
+}
+
+// like wpng_load, but decodes into dest instead of allocating, with dest_stride bytes from the start of one row to the next
+// the image's top left pixel goes x_offset pixels and y_offset rows into dest, and output->data points at it
+// dest_size must be at least wpng_dest_size(...) for the image (wpng_probe can tell its size and bytes per pixel beforehand), otherwise fails with error 12
+// dest is left partially written if decoding fails partway through
+static inline void wpng_load_into(byte_buffer * buf, uint32_t flags, uint8_t * dest, size_t dest_size, size_t dest_stride, uint32_t x_offset, uint32_t y_offset, wpng_load_output * output)
+{
+    assert(dest);
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    target.dest = dest;
+    target.dest_size = dest_size;
+    target.dest_stride = dest_stride;
+    target.x_offset = x_offset;
+    target.y_offset = y_offset;
+    wpng_decode(buf, flags, &target, output);
+}
+
+// like wpng_load, but only decodes columns [x0, x1) and rows [y0, y1), and outputs them as an image of (x1 - x0) by (y1 - y0) pixels
+// x1 or y1 of 0 mean the right or bottom edge; fails with error 13 if the region is empty or goes past the edge of the image
+// rows above the region are still decompressed and defiltered (png has no way to skip them), but into a single scratch row
+// image data after row y1 (of the last adam7 pass, if interlaced) isn't read at all, so the zlib checksum isn't checked unless y1 is the bottom edge
+static inline void wpng_load_region(byte_buffer * buf, uint32_t flags, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    target.x0 = x0;
+    target.y0 = y0;
+    target.x1 = x1;
+    target.y1 = y1;
+    wpng_decode(buf, flags, &target, output);
+}
+
+// like wpng_load, but outputs the image at 1/scale of its size (rounded up), for scale 2, 4 or 8 (1 is full size); fails with error 13 for other scales
+// interlaced images only get decompressed up to the last adam7 pass needed, and are point sampled (the pixel at the top left of each block)
+// non-interlaced images are decompressed as a whole and box filtered, one row at a time
+// like with wpng_load_region, the zlib checksum isn't checked if some of the image data isn't read
+static inline void wpng_load_scaled(byte_buffer * buf, uint32_t flags, uint8_t scale, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    target.scale = scale;
+    wpng_decode(buf, flags, &target, output);
+}
+
+// like wpng_load, but takes its memory from decoder: output->data is allocated with the decoder's allocator (and has to be freed with it),
+//  and scratch memory is kept in the decoder for the next call instead of being freed
+static inline void wpng_decoder_load(wpng_decoder * decoder, byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+{
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    wpng_decoder_decode(decoder, buf, flags, &target, output);
+}
+
+// like wpng_load_into, but keeps scratch memory in decoder; once the decoder's scratch buffers are big enough, this doesn't allocate at all
+static inline void wpng_decoder_load_into(wpng_decoder * decoder, byte_buffer * buf, uint32_t flags, uint8_t * dest, size_t dest_size, size_t dest_stride, uint32_t x_offset, uint32_t y_offset, wpng_load_output * output)
+{
+    assert(dest);
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    target.dest = dest;
+    target.dest_size = dest_size;
+    target.dest_stride = dest_stride;
+    target.x_offset = x_offset;
+    target.y_offset = y_offset;
+    wpng_decoder_decode(decoder, buf, flags, &target, output);
+}
+
+// maps a whole file into buf, or reads it into the decoder's file scratch buffer if it isn't mapped
+// returns 0 on success, 15 if the file can't be read, or 100 if the buffer can't be allocated
+static uint8_t wpng_decoder_read_file(wpng_decoder * decoder, wpng_file * file, byte_buffer * buf)
+{
+    memset(buf, 0, sizeof(byte_buffer));
+    buf->fixed = 1;
+    if (file->data)
+    {
+        // (the decoder never writes to its input)
+        buf->data = (uint8_t *)file->data;
+        buf->len = file->size;
+        buf->cap = file->size;
+        return 0;
+    }
+    
+    // a byte more than the file's size, so that finding the end of the file doesn't need a bigger buffer
+    size_t len = 0;
+    uint8_t * data = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_FILE, file->size ? file->size + 1 : (1 << 16));
+    if (!data)
+        return 100;
+    size_t cap = decoder->scratch_size[WPNG_SCRATCH_FILE];
+    while (1)
+    {
+        // files of unknown size (e.g. pipes) can need a bigger buffer, keeping what has been read so far
+        if (len == cap)
+        {
+            uint8_t * next = cap <= SIZE_MAX / 2 ? (uint8_t *)wpng_alloc(decoder, cap * 2) : 0;
+            if (!next)
+                return 100;
+            memcpy(next, data, len);
+            wpng_free(decoder, data);
+            data = next;
+            cap *= 2;
+            decoder->scratch[WPNG_SCRATCH_FILE] = data;
+            decoder->scratch_size[WPNG_SCRATCH_FILE] = cap;
+        }
+        size_t amount = wpng_file_read(file, &data[len], cap - len);
+        if (amount == SIZE_MAX)
+            return 15;
+        if (amount == 0)
+            break;
+        len += amount;
+    }
+    buf->data = data;
+    buf->len = len;
+    buf->cap = cap;
+    return 0;
+}
+
+// like wpng_decoder_load, but for the png file at path, which is memory mapped and decoded in place if it's a big enough regular file (see wpng_file.h)
+// fails with error 15 if the file can't be opened or read
+static inline void wpng_decoder_load_file(wpng_decoder * decoder, const char * path, uint32_t flags, wpng_load_output * output)
+{
+    wpng_file file;
+    WPNG_ASSERT(wpng_file_open(&file, path), 15);
+    byte_buffer buf;
+    uint8_t error = wpng_decoder_read_file(decoder, &file, &buf);
+    if (!error)
+    {
+        wpng_decode_target target;
+        memset(&target, 0, sizeof(target));
+        wpng_decoder_decode(decoder, &buf, flags, &target, output);
+    }
+    wpng_file_close(&file);
+    WPNG_ASSERT(!error, error);
+}
+
+// like wpng_load, but for the png file at path (see wpng_decoder_load_file)
+static inline void wpng_load_file(const char * path, uint32_t flags, wpng_load_output * output)
+{
+    wpng_decoder decoder;
+    wpng_decoder_init(&decoder, 0);
+    wpng_decoder_load_file(&decoder, path, flags, output);
+    wpng_decoder_free(&decoder);
+}
+
+typedef struct {
+    wpng_decoder * decoders;
+    byte_buffer * bufs;
+    uint32_t flags;
+    wpng_load_output * outputs;
+    const wpng_task_size * order; // null to go in the order they were given in
+} wpng_load_batch_job;
+
+static void wpng_load_batch_image(void * userdata, size_t index, uint32_t thread)
+{
+    wpng_load_batch_job * job = (wpng_load_batch_job *)userdata;
+    size_t i = job->order ? job->order[index].index : index;
+    wpng_decode_target target;
+    memset(&target, 0, sizeof(target));
+    wpng_decoder_decode(&job->decoders[thread], &job->bufs[i], job->flags, &target, &job->outputs[i]);
+}
+
+// decodes bufs[i] into outputs[i] for every i in [0, count), like wpng_decoder_load, on up to thread_count threads at once (see wpng_thread.h)
+// decoders is an array of thread_count decoders: each thread decodes all of its images with its own one, so keeping them between batches means only
+//  the output images are allocated once their scratch memory has grown enough; outputs[i].data is allocated by whichever decoder decoded it
+// images are handed out biggest file first, so that a big image left over at the end doesn't keep every other thread waiting for it
+// with more than one image, each image is decoded on a single thread (as with WPNG_READ_NO_THREADS)
+static void wpng_decoder_load_batch(wpng_decoder * decoders, uint32_t thread_count, byte_buffer * bufs, size_t count, uint32_t flags, wpng_load_output * outputs)
+{
+    assert(decoders);
+    assert(thread_count > 0);
+    
+    wpng_load_batch_job job;
+    job.decoders = decoders;
+    job.bufs = bufs;
+    job.flags = count > 1 ? flags | WPNG_READ_NO_THREADS : flags;
+    job.outputs = outputs;
+    job.order = 0;
+    // (if there's no memory for this, the images just go in the order they're in)
+    wpng_task_size * order = count > 1 ? (wpng_task_size *)wpng_scratch(&decoders[0], WPNG_SCRATCH_BATCH, sizeof(wpng_task_size) * count) : 0;
+    if (order)
+    {
+        for (size_t i = 0; i < count; i += 1)
+        {
+            order[i].size = bufs[i].len;
+            order[i].index = i;
+        }
+        wpng_task_sort(order, count);
+        job.order = order;
+    }
+    wpng_parallel_for(count, thread_count, wpng_load_batch_image, &job);
+}
+
+// like wpng_decoder_load_batch, with one decoder (using malloc and free) per cpu core that only lives for this one call
+static inline void wpng_load_batch(byte_buffer * bufs, size_t count, uint32_t flags, wpng_load_output * outputs)
+{
+    wpng_decoder decoders[WPNG_MAX_THREADS];
+    uint32_t thread_count = wpng_thread_count();
+    for (uint32_t i = 0; i < thread_count; i += 1)
+        wpng_decoder_init(&decoders[i], 0);
+    wpng_decoder_load_batch(decoders, thread_count, bufs, count, flags, outputs);
+    for (uint32_t i = 0; i < thread_count; i += 1)
+        wpng_decoder_free(&decoders[i]);
+}
+
+// reads only the signature and the chunks before the image data, without decompressing or allocating anything
+// flags mean the same as for wpng_load, and output describes what wpng_load would output with them
+// on error, writes nonzero to the "error" value of output and leaves the rest untouched
+static inline void wpng_probe(byte_buffer * buf, uint32_t flags, wpng_info * output)
+{
+    assert(output);
+    
+    wpng_header header;
+    wpng_limits limits;
+    wpng_limits_default(&limits);
+    wpng_read_chunks(buf, flags, 1, &limits, 0, 0, &header);
+    WPNG_ASSERT(!header.error, header.error);
+    WPNG_ASSERT(wpng_format_supported(&header, flags), 14);
+    size_t bytes_per_scanline = wpng_output_row_size(&header, flags, header.width);
+    WPNG_ASSERT(!limits.max_decoded_bytes || (uint64_t)bytes_per_scanline * header.height <= limits.max_decoded_bytes, 18);
+    
+    uint8_t bpp = wpng_output_bpp(&header, flags);
+    float gamma = header.gamma;
+    if (header.is_srgb || (flags & WPNG_READ_SKIP_GAMMA_CORRECTION))
+        gamma = -1.0;
+    
+    output->error = 0;
+    
+    output->bytes_per_scanline = bytes_per_scanline;
+    output->size = bytes_per_scanline * header.height;
+    output->width = header.width;
+    output->height = header.height;
+    output->gamma = gamma;
+    output->bytes_per_pixel = bpp;
+    output->is_16bit = wpng_output_is_16bit(&header, flags);
+    output->was_16bit = header.bit_depth == 16;
+    output->was_srgb = header.is_srgb;
+    output->bit_depth = header.bit_depth;
+    output->color_type = header.color_type;
+    output->is_interlaced = header.interlacing != 0;
+    output->has_trns = header.has_trns;
+    output->has_gama = header.gamma >= 0.0;
+    output->palette_size = 0;
+    if (wpng_is_index_format(wpng_read_format(flags)))
+        output->palette_size = wpng_index_palette(&header, gamma, output->palette);
+}
+
+// output of wpng_verify
+typedef struct {
+    uint64_t image_data_size; // decompressed size of the image data
+    size_t error_offset; // where the first problem is: the start of the chunk (its length field) that's broken, or where decompressing the image data failed
+    uint8_t error; // as for wpng_load, with 21 if the image data doesn't decompress to exactly as much as the header says
+} wpng_verify_output;
+
+// checks that a png is intact without decoding it: its signature, its chunks and their ordering, every chunk's crc (ancillary ones too),
+//  and its image data, which has to decompress with the right adler32 to exactly as many bytes as the header says (without being defiltered)
+// nothing is allocated for the image: decompressed data goes through a 32 KiB buffer and is thrown away
+// the only flag that counts is WPNG_READ_SKIP_CRITICAL_CHUNKS; decoder->limits apply, except max_extra_image_data
+// on error, output->error is nonzero and output->error_offset says where in buf the problem is
+static void wpng_decoder_verify(wpng_decoder * decoder, byte_buffer * buf, uint32_t flags, wpng_verify_output * output)
+{
+    assert(decoder);
+    assert(output);
+    
+    output->image_data_size = 0;
+    output->error_offset = 0;
+    wpng_header header;
+    wpng_read_chunks(buf, (flags & WPNG_READ_SKIP_CRITICAL_CHUNKS) | WPNG_READ_ERROR_ON_BAD_ANCILLARY_CRC, 0, &decoder->limits, decoder->chunk_callback, decoder->chunk_userdata, &header);
+    output->error_offset = header.error_offset;
+    WPNG_ASSERT(!header.error, header.error);
+    
+    output->error_offset = header.idat_start - 8;
+    uint8_t * stream_memory = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_INFLATE, INFL_STREAM_MEMORY_SIZE);
+    uint8_t * window = (uint8_t *)wpng_scratch(decoder, WPNG_SCRATCH_ROWS, 1 << 15);
+    WPNG_ASSERT(stream_memory && window, 100);
+    
+    uint64_t expected_size = wpng_image_data_size(&header);
+    infl_stream stream;
+    infl_stream_init_with(&stream, buf->data, header.idat_start, header.idat_start + header.idat_size, wpng_next_idat, buf, 1, stream_memory);
+    while (stream.state != INFL_STATE_DONE && !stream.error && stream.total_out <= expected_size)
+        infl_stream_read(&stream, window, 1 << 15);
+    
+    output->image_data_size = stream.total_out;
+    // (whole bytes that were loaded but not used yet don't count as read)
+    output->error_offset = stream.input.pos - stream.input.bit_count / 8;
+    WPNG_ASSERT(!stream.error, stream.input.overrun ? 2 : 11);
+    WPNG_ASSERT(stream.total_out == expected_size, 21);
+    output->error_offset = 0;
+    output->error = 0;
+}
+
+// like wpng_decoder_verify, with a decoder that only lives for this one call
+static inline void wpng_verify(byte_buffer * buf, uint32_t flags, wpng_verify_output * output)
+{
+    wpng_decoder decoder;
+    wpng_decoder_init(&decoder, 0);
+    wpng_decoder_verify(&decoder, buf, flags, output);
+    wpng_decoder_free(&decoder);
 }
 
 #endif // WPNG_READ_INCLUDED
@@ -0,0 +1,204 @@
+#ifndef WPNG_THREAD_INCLUDED
+#define WPNG_THREAD_INCLUDED
+
+// you probably want:
+// wpng_read.h
+
+// runs independent pieces of work (e.g. bands of an image) on several threads at once
+// threads are only used if WPNG_ENABLE_THREADS is defined, in which case pthreads (or win32 threads on windows) are needed;
+//  otherwise everything runs on the calling thread, one piece after another
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifdef WPNG_ENABLE_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
+
+// most threads that wpng_parallel_for runs at once, including the calling thread
+#ifndef WPNG_MAX_THREADS
+#define WPNG_MAX_THREADS 64
+#endif
+
+// `thread` is which of the threads is running the call, from 0 to thread_count - 1, e.g. for picking scratch memory that no other call is using at the same time
+typedef void (*wpng_task_func)(void * userdata, size_t index, uint32_t thread);
+
+typedef struct {
+    wpng_task_func func;
+    void * userdata;
+    size_t count;
+    size_t next; // first index that no thread has taken yet
+#ifdef WPNG_ENABLE_THREADS
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+#endif
+} wpng_task_list;
+
+typedef struct {
+    wpng_task_list * list;
+    uint32_t thread;
+} wpng_task_thread_args;
+
+// how many threads wpng_parallel_for can usefully run at once: the number of cpu cores, or 1 if threads aren't enabled
+static inline uint32_t wpng_thread_count(void)
+{
+    long count = 1;
+#if defined(WPNG_ENABLE_THREADS) && defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = info.dwNumberOfProcessors;
+#elif defined(WPNG_ENABLE_THREADS)
+    count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count < 1)
+        count = 1;
+    if (count > WPNG_MAX_THREADS)
+        count = WPNG_MAX_THREADS;
+    return count;
+}
+
+// a piece of work and roughly how long it takes, for wpng_task_sort
+typedef struct {
+    uint64_t size;
+    size_t index;
+} wpng_task_size;
+
+// biggest first, then in order of index
+static inline int wpng_task_size_compare(const void * _a, const void * _b)
+{
+    const wpng_task_size * a = (const wpng_task_size *)_a;
+    const wpng_task_size * b = (const wpng_task_size *)_b;
+    if (a->size != b->size)
+        return a->size < b->size ? 1 : -1;
+    return a->index > b->index ? 1 : a->index < b->index ? -1 : 0;
+}
+
+// puts tasks in the order to hand them out to wpng_parallel_for in: biggest first, so that small ones fill in the gaps at the end,
+//  instead of a big one starting last and keeping every other thread waiting for it
+static inline void wpng_task_sort(wpng_task_size * tasks, size_t count)
+{
+    qsort(tasks, count, sizeof(wpng_task_size), wpng_task_size_compare);
+}
+
+// takes the next index that needs to be run, or returns list->count if there are none left
+static inline size_t wpng_task_take(wpng_task_list * list)
+{
+#ifdef WPNG_ENABLE_THREADS
+#ifdef _WIN32
+    EnterCriticalSection(&list->lock);
+#else
+    pthread_mutex_lock(&list->lock);
+#endif
+#endif
+    size_t index = list->next;
+    if (index < list->count)
+        list->next += 1;
+#ifdef WPNG_ENABLE_THREADS
+#ifdef _WIN32
+    LeaveCriticalSection(&list->lock);
+#else
+    pthread_mutex_unlock(&list->lock);
+#endif
+#endif
+    return index;
+}
+
+static inline void wpng_task_run(wpng_task_list * list, uint32_t thread)
+{
+    for (size_t index = wpng_task_take(list); index < list->count; index = wpng_task_take(list))
+        list->func(list->userdata, index, thread);
+}
+
+#ifdef WPNG_ENABLE_THREADS
+#ifdef _WIN32
+static DWORD WINAPI wpng_task_thread(LPVOID userdata)
+{
+    wpng_task_thread_args * args = (wpng_task_thread_args *)userdata;
+    wpng_task_run(args->list, args->thread);
+    return 0;
+}
+#else
+static void * wpng_task_thread(void * userdata)
+{
+    wpng_task_thread_args * args = (wpng_task_thread_args *)userdata;
+    wpng_task_run(args->list, args->thread);
+    return 0;
+}
+#endif
+#endif
+
+// calls func(userdata, i, thread) for every i in [0, count), on up to thread_count threads at once (the calling thread is one of them), and returns once all calls have returned
+// indices are handed out in order to whichever thread is free, so pieces of work that take different amounts of time still even out
+// if threads can't be started, the ones that did start (or just the calling thread) do all of the work
+static void wpng_parallel_for(size_t count, uint32_t thread_count, wpng_task_func func, void * userdata)
+{
+    if (thread_count > count)
+        thread_count = count;
+    if (thread_count > WPNG_MAX_THREADS)
+        thread_count = WPNG_MAX_THREADS;
+    
+#ifdef WPNG_ENABLE_THREADS
+    if (thread_count > 1)
+    {
+        wpng_task_list list;
+        list.func = func;
+        list.userdata = userdata;
+        list.count = count;
+        list.next = 0;
+        
+        uint32_t started = 0;
+        wpng_task_thread_args args[WPNG_MAX_THREADS];
+        for (uint32_t i = 0; i + 1 < thread_count; i += 1)
+        {
+            args[i].list = &list;
+            args[i].thread = i + 1;
+        }
+#ifdef _WIN32
+        HANDLE threads[WPNG_MAX_THREADS];
+        InitializeCriticalSection(&list.lock);
+        for (uint32_t i = 1; i < thread_count; i += 1)
+        {
+            threads[started] = CreateThread(0, 0, wpng_task_thread, &args[started], 0, 0);
+            if (!threads[started])
+                break;
+            started += 1;
+        }
+        wpng_task_run(&list, 0);
+        for (uint32_t i = 0; i < started; i += 1)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        DeleteCriticalSection(&list.lock);
+#else
+        pthread_t threads[WPNG_MAX_THREADS];
+        pthread_mutex_init(&list.lock, 0);
+        for (uint32_t i = 1; i < thread_count; i += 1)
+        {
+            if (pthread_create(&threads[started], 0, wpng_task_thread, &args[started]) != 0)
+                break;
+            started += 1;
+        }
+        wpng_task_run(&list, 0);
+        for (uint32_t i = 0; i < started; i += 1)
+            pthread_join(threads[i], 0);
+        pthread_mutex_destroy(&list.lock);
+#endif
+        return;
+    }
+#endif
+    // (on one thread there's no task list, and no lock to take indices from it with)
+    for (size_t i = 0; i < count; i += 1)
+        func(userdata, i, 0);
+}
+
+#endif //WPNG_THREAD_INCLUDED
@@ -3,6 +3,11 @@
 
 // you probably want:
 // static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+// or, to write into memory you already have:
+// static size_t wpng_write_bound(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit)
+// static size_t wpng_write_to(uint8_t * dest, size_t dest_size, uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+// or, for many images at once:
+// static inline void wpng_write_batch(const wpng_write_image * images, size_t count, uint32_t flags, int8_t compression_quality, byte_buffer * outputs)
 
 #include <stdint.h>
 #include <stddef.h>
@@ -11,6 +16,7 @@
 #include "deflate.h"
 #include "buffers.h"
 #include "wpng_common.h"
+#include "wpng_thread.h"
 
 inline static int luma_compare(const void * _a, const void * _b)
 {
@@ -42,14 +48,297 @@ inline static uint32_t pal_val_expand(uint32_t val, uint8_t bpp)
     return val;
 }
 
+// picks a filter for the scanline with the sum-of-absolutes heuristic, then pushes the filter type and the filtered scanline to `out`
+// `prev_row` must be null for the first scanline
+// with `no_prev_row`, only filters that don't look at prev_row are picked (for the first scanline of a band, see WPNG_WRITE_PARALLEL_DECODE)
+static void filter_scanline(byte_buffer * out, const uint8_t * row, const uint8_t * prev_row, size_t bytes_per_scanline, uint8_t bpp, int8_t compression_quality, uint64_t * num_unfiltered, size_t y, uint32_t height, uint8_t no_prev_row)
+{
+    uint64_t sum_abs_null = 0;
+    uint64_t sum_abs_left = 0;
+    uint64_t sum_abs_top = 0;
+    uint64_t sum_abs_avg = 0;
+    uint64_t sum_abs_paeth = 0;
+    
+    uint64_t hit_vals[256] = {0};
+    uint8_t most_common_val = 0;
+    uint64_t most_common_count = 0;
+    
+    if (compression_quality > 0)
+    {
+        for (size_t x = 0; x < bytes_per_scanline; x++)
+        {
+            uint8_t val = row[x];
+            hit_vals[val] += 1;
+            if (hit_vals[val] > most_common_count)
+            {
+                most_common_count = hit_vals[val];
+                most_common_val = val;
+            }
+        }
+        
+        for (size_t x = 0; x < bytes_per_scanline; x++)
+        {
+            sum_abs_null += abs((int32_t)(int8_t)(row[x] - most_common_val));
+            
+            uint16_t up     = prev_row ? prev_row[x] : 0;
+            uint16_t left   = x >= bpp ? row[x - bpp] : 0;
+            uint16_t upleft = prev_row && x >= bpp ? prev_row[x - bpp] : 0;
+            uint8_t avg = (up + left) / 2;
+            sum_abs_avg += abs((int32_t)(row[x]) - (int32_t)(avg));
+            
+            sum_abs_left += abs((int32_t)(row[x]) - (int32_t)left);
+            
+            sum_abs_top += abs((int32_t)(row[x]) - (int32_t)up);
+            
+            uint8_t ref = paeth_get_ref_raw(left, up, upleft);
+            sum_abs_paeth += abs((int32_t)(row[x]) - (int32_t)(ref));
+        }
+    }
+    
+    if (!prev_row)
+        sum_abs_top = -1;
+    if (no_prev_row)
+    {
+        sum_abs_top = -1;
+        sum_abs_avg = -1;
+        sum_abs_paeth = -1;
+    }
+    
+    // bias in favor of storing unfiltered if enough (25%) earlier scanlines are stored unfiltered
+    // this helps with deflate's lz77 pass
+    if (*num_unfiltered > y / height / 4)
+        sum_abs_null /= 3;
+    
+    if (compression_quality == 0 || (sum_abs_null <= sum_abs_left && sum_abs_null <= sum_abs_top && sum_abs_null <= sum_abs_avg && sum_abs_null <= sum_abs_paeth))
+    {
+        *num_unfiltered += 1;
+        //puts("picked filter mode 0");
+        byte_push(out, 0); // no filter
+        bytes_push(out, row, bytes_per_scanline);
+    }
+    else if (sum_abs_left <= sum_abs_top && sum_abs_left <= sum_abs_avg && sum_abs_left <= sum_abs_paeth)
+    {
+        //puts("picked filter mode 1");
+        byte_push(out, 1); // left filter
+        for (size_t x = 0; x < bpp; x++)
+            byte_push(out, row[x]);
+        for (size_t x = bpp; x < bytes_per_scanline; x++)
+            byte_push(out, row[x] - row[x - bpp]);
+    }
+    else if (sum_abs_top <= sum_abs_avg && sum_abs_top <= sum_abs_paeth)
+    {
+        //puts("picked filter mode 2");
+        byte_push(out, 2); // top filter
+        for (size_t x = 0; x < bytes_per_scanline; x++)
+            byte_push(out, row[x] - prev_row[x]);
+    }
+    else if (sum_abs_avg <= sum_abs_paeth)
+    {
+        //puts("picked filter mode 3");
+        byte_push(out, 3); // avg filter
+        for (size_t x = 0; x < bytes_per_scanline; x++)
+        {
+            uint16_t up   = prev_row ? prev_row[x] : 0;
+            uint16_t left = x >= bpp ? row[x - bpp] : 0;
+            uint8_t avg = (up + left) / 2;
+            byte_push(out, row[x] - avg);
+        }
+    }
+    else
+    {
+        //puts("picked filter mode 4");
+        byte_push(out, 4); // paeth filter
+        for (size_t x = 0; x < bytes_per_scanline; x++)
+        {
+            uint16_t up     = prev_row ? prev_row[x] : 0;
+            uint16_t left   = x >= bpp ? row[x - bpp] : 0;
+            uint16_t upleft = prev_row && x >= bpp ? prev_row[x - bpp] : 0;
+            byte_push(out, row[x] - paeth_get_ref_raw(left, up, upleft));
+        }
+    }
+}
+
+// packs one byte per pixel into rows of `depth`-bit samples, mapping each byte through `lut` first
+static uint8_t * pack_samples(uint32_t width, uint32_t height, const uint8_t * image_data, size_t bytes_per_scanline, const uint8_t * lut, uint8_t depth, size_t * size)
+{
+    size_t out_bps = ((size_t)width * depth + 7) / 8;
+    uint8_t * output = (uint8_t *)malloc(out_bps * height);
+    assert(output);
+    memset(output, 0, out_bps * height);
+    
+    for (size_t y = 0; y < height; y += 1)
+    {
+        for (size_t x = 0; x < width; x += 1)
+        {
+            uint8_t n = x % (8 / depth);
+            size_t i = x / (8 / depth);
+            uint32_t orval = (uint32_t)lut[image_data[y * bytes_per_scanline + x]] << (uint32_t)(8 - ((n + 1) * depth));
+            assert(orval < 256);
+            output[y * out_bps + i] |= orval;
+        }
+    }
+    
+    if (size)
+        *size = out_bps * height;
+    return output;
+}
+
+// cheap estimate of how well a packed single-channel image compresses: filters and quickly deflates evenly spaced bands of its scanlines
+static size_t estimate_compressed_size(const uint8_t * image_data, uint32_t height, size_t bytes_per_scanline)
+{
+    // look at roughly 256k bytes of the image at most
+    const size_t band_rows = 8;
+    size_t sample_rows = ((size_t)1 << 18) / (bytes_per_scanline + 1) + 1;
+    size_t band_count = (sample_rows + band_rows - 1) / band_rows;
+    size_t band_stride = band_count * band_rows >= height ? band_rows : height / band_count;
+    
+    byte_buffer filtered;
+    memset(&filtered, 0, sizeof(filtered));
+    uint64_t num_unfiltered = 0;
+    for (size_t y_band = 0; y_band < height; y_band += band_stride)
+    {
+        for (size_t y = y_band; y < y_band + band_rows && y < height; y += 1)
+        {
+            const uint8_t * row = &image_data[bytes_per_scanline * y];
+            filter_scanline(&filtered, row, y > 0 ? row - bytes_per_scanline : 0, bytes_per_scanline, 1, 1, &num_unfiltered, y, height, 0);
+        }
+    }
+    
+    bit_buffer compressed = do_deflate(filtered.data, filtered.len, 1, 0);
+    size_t ret = compressed.buffer.len;
+    free(compressed.buffer.data);
+    free(filtered.data);
+    return ret;
+}
+
+// palette orderings. each one fills `order` with palette indices (in order of discovery) in their new order.
+
+static void palette_order_luma(const uint32_t * palette, uint32_t count, uint8_t * order)
+{
+    uint32_t sorted[256];
+    memcpy(sorted, palette, sizeof(uint32_t) * count);
+    qsort(sorted, count, sizeof(uint32_t), luma_compare);
+    for (size_t i = 0; i < count; i += 1)
+    {
+        size_t j = 0;
+        while (palette[j] != sorted[i])
+            j += 1;
+        order[i] = j;
+    }
+}
+
+// most common colors first
+static void palette_order_frequency(const uint64_t * counts, uint32_t count, uint8_t * order)
+{
+    // stuff the index into the bottom bits; ties go to whichever color was found first
+    int64_t keys[256];
+    for (size_t i = 0; i < count; i += 1)
+        keys[i] = (counts[i] << 8) | (255 - i);
+    qsort(keys, count, sizeof(int64_t), count_compare);
+    for (size_t i = 0; i < count; i += 1)
+        order[i] = 255 - (keys[i] & 0xFF);
+}
+
+static inline uint32_t palette_color_distance(uint32_t a, uint32_t b)
+{
+    uint32_t dist = 0;
+    for (size_t i = 0; i < 32; i += 8)
+    {
+        int32_t diff = (int32_t)((a >> i) & 0xFF) - (int32_t)((b >> i) & 0xFF);
+        dist += diff * diff;
+    }
+    return dist;
+}
+
+// greedy nearest-neighbor walk through color space, starting from the darkest color
+static void palette_order_nearest(const uint32_t * palette, uint32_t count, uint8_t * order)
+{
+    uint8_t used[256] = {0};
+    palette_order_luma(palette, count, order);
+    uint8_t current = order[0];
+    used[current] = 1;
+    for (size_t i = 1; i < count; i += 1)
+    {
+        uint32_t best = 0;
+        uint32_t best_dist = 0xFFFFFFFF;
+        for (size_t j = 0; j < count; j += 1)
+        {
+            uint32_t dist = palette_color_distance(palette[current], palette[j]);
+            if (!used[j] && dist < best_dist)
+            {
+                best = j;
+                best_dist = dist;
+            }
+        }
+        order[i] = best;
+        used[best] = 1;
+        current = best;
+    }
+}
+
+// greedy walk starting from the most common color, always picking the color that most often borders the previous one in the image
+// this keeps the index deltas between neighboring pixels small, which helps the png filters
+// `adjacency` is a 256x256 matrix of how often two palette indices are horizontal or vertical neighbors
+static void palette_order_adjacency(const uint32_t * palette, const uint64_t * counts, const uint32_t * adjacency, uint32_t count, uint8_t * order)
+{
+    uint8_t used[256] = {0};
+    uint8_t current = 0;
+    for (size_t j = 1; j < count; j += 1)
+    {
+        if (counts[j] > counts[current])
+            current = j;
+    }
+    order[0] = current;
+    used[current] = 1;
+    for (size_t i = 1; i < count; i += 1)
+    {
+        uint32_t best = 0;
+        uint64_t best_adjacency = 0;
+        uint32_t best_dist = 0xFFFFFFFF;
+        for (size_t j = 0; j < count; j += 1)
+        {
+            if (used[j])
+                continue;
+            uint64_t adj = (uint64_t)adjacency[current * 256 + j] + adjacency[j * 256 + current];
+            uint32_t dist = palette_color_distance(palette[current], palette[j]);
+            if (adj > best_adjacency || (adj == best_adjacency && dist < best_dist))
+            {
+                best = j;
+                best_adjacency = adj;
+                best_dist = dist;
+            }
+        }
+        order[i] = best;
+        used[best] = 1;
+        current = best;
+    }
+}
+
+static uint8_t * palette_pack(uint32_t width, uint32_t height, const uint8_t * indices, const uint8_t * order, uint32_t count, uint8_t depth, size_t * size)
+{
+    uint8_t remap[256] = {0};
+    for (size_t i = 0; i < count; i += 1)
+        remap[order[i]] = i;
+    return pack_samples(width, height, indices, width, remap, depth, size);
+}
+
 // image must be 8-bit y, ya, rgb, or rgba. does not support 16-bit.
 // returns null on failure, pointer on success
 // `pal` must have space for 256 entries
-static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t * image_data, size_t bytes_per_scanline, size_t * size, uint32_t * pal, uint32_t * pal_count, uint32_t * arg_depth)
+// if `trns_key` is non-null, pixels equal to *trns_key (raw y or rgb value) are given zero alpha
+// palette entries are sorted by luma, or, if `optimize_order` is set, by whichever of several orderings looks like it compresses best
+static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t * image_data, size_t bytes_per_scanline, const uint32_t * trns_key, uint8_t optimize_order, size_t * size, uint32_t * pal, uint32_t * pal_count, uint32_t * arg_depth)
 {
+    uint32_t key = trns_key ? pal_val_expand(*trns_key, bpp) : 0;
+    
     uint32_t palette[256] = {0};
+    uint64_t counts[256] = {0};
     uint32_t palette_i = 0;
     
+    // palette indices in order of discovery, one byte per pixel
+    uint8_t * indices = (uint8_t *)malloc((size_t)width * height);
+    assert(indices);
+    
     for (size_t y = 0; y < height; y += 1)
     {
         for (size_t x = 0; x < width; x += 1)
@@ -61,6 +350,8 @@ static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t
                 val |= image_data[y * bytes_per_scanline + x * bpp + j];
             }
             val = pal_val_expand(val, bpp);
+            if (trns_key && val == key)
+                val &= 0xFFFFFF00;
             
             size_t index = 0;
             while (index < palette_i && palette[index] != val)
@@ -69,20 +360,25 @@ static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t
             if (index == palette_i || palette_i == 0)
             {
                 if (palette_i == 256)
+                {
+                    free(indices);
                     return 0;
+                }
                 else
                 {
                     palette[palette_i] = val;
                     palette_i += 1;
                 }
             }
+            indices[y * width + x] = index;
+            counts[index] += 1;
         }
     }
-    // sort palette by luma to help png's byte filter compress better
-    if (palette_i > 0)
-        qsort(palette, palette_i, sizeof(uint32_t), luma_compare);
-    else
+    if (palette_i == 0)
+    {
+        free(indices);
         return 0;
+    }
     
     //for (size_t i = 0; i < palette_i; i += 1)
     //    printf("%08X\n", palette[i]);
@@ -101,40 +397,59 @@ static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t
     
     assert(palette_i <= 256);
     
-    size_t out_bps = (width * depth + 7) / 8;
-    
-    uint8_t * output = (uint8_t *)malloc(out_bps * height);
-    assert(output);
-    memset(output, 0, out_bps * height);
+    // sort palette by luma to help png's byte filter compress better
+    uint8_t order[256] = {0};
+    palette_order_luma(palette, palette_i, order);
+    size_t out_size = 0;
+    uint8_t * output = palette_pack(width, height, indices, order, palette_i, depth, &out_size);
     
-    for (size_t y = 0; y < height; y += 1)
+    if (optimize_order && palette_i > 2)
     {
-        for (size_t x = 0; x < width; x += 1)
+        uint32_t * adjacency = (uint32_t *)malloc(sizeof(uint32_t) * 256 * 256);
+        assert(adjacency);
+        memset(adjacency, 0, sizeof(uint32_t) * 256 * 256);
+        for (size_t y = 0; y < height; y += 1)
         {
-            uint32_t val = 0;
-            for (size_t j = 0; j < bpp; j += 1)
+            for (size_t x = 0; x < width; x += 1)
             {
-                val <<= 8;
-                val |= image_data[y * bytes_per_scanline + x * bpp + j];
+                uint8_t index = indices[y * width + x];
+                if (x > 0)
+                    adjacency[indices[y * width + x - 1] * 256 + index] += 1;
+                if (y > 0)
+                    adjacency[indices[(y - 1) * width + x] * 256 + index] += 1;
             }
-            val = pal_val_expand(val, bpp);
-            
-            size_t index = 0;
-            while (index < palette_i && palette[index] != val)
-                index += 1;
-            
-            assert(index < palette_i);
+        }
+        
+        size_t best_size = estimate_compressed_size(output, height, out_size / height);
+        for (uint8_t n = 0; n < 3; n += 1)
+        {
+            uint8_t candidate_order[256] = {0};
+            if (n == 0)
+                palette_order_frequency(counts, palette_i, candidate_order);
+            else if (n == 1)
+                palette_order_nearest(palette, palette_i, candidate_order);
+            else
+                palette_order_adjacency(palette, counts, adjacency, palette_i, candidate_order);
             
-            uint8_t n = x % (8 / depth);
-            size_t i = x / (8 / depth);
-            uint32_t orval = index << (uint32_t)(8 - ((n + 1) * depth));
-            assert(orval < 256);
-            output[y * out_bps + i] |= orval;
+            uint8_t * candidate = palette_pack(width, height, indices, candidate_order, palette_i, depth, 0);
+            size_t candidate_size = estimate_compressed_size(candidate, height, out_size / height);
+            if (candidate_size < best_size)
+            {
+                free(output);
+                output = candidate;
+                best_size = candidate_size;
+                memcpy(order, candidate_order, sizeof(order));
+            }
+            else
+                free(candidate);
         }
+        
+        free(adjacency);
     }
+    free(indices);
     
     if (size)
-        *size = out_bps * height;
+        *size = out_size;
     if (arg_depth)
         *arg_depth = depth;
     if (pal_count)
@@ -142,33 +457,309 @@ static uint8_t * palettize(uint32_t width, uint32_t height, uint8_t bpp, uint8_t
     if (pal)
     {
         for (size_t i = 0; i < palette_i; i += 1)
-            pal[i] = palette[i];
+            pal[i] = palette[order[i]];
+    }
+    
+    return output;
+}
+
+// copies the pixels of one row of an adam7 pass (1~7) out of a packed scanline into `out_row`, which must be `pass_bps` bytes long
+static void interlace_row(const uint8_t * row, size_t pass_width, uint8_t bits_per_pixel, uint8_t pass, uint8_t * out_row, size_t pass_bps)
+{
+    size_t x_init = adam7_x_inits[pass];
+    size_t x_gap = adam7_x_gaps[pass];
+    
+    size_t bytes_per_pixel = bits_per_pixel / 8;
+    if (bits_per_pixel < 8)
+        memset(out_row, 0, pass_bps);
+    for (size_t x = 0; x < pass_width; x += 1)
+    {
+        size_t x_in = x * x_gap + x_init;
+        if (bits_per_pixel >= 8)
+            memcpy(&out_row[x * bytes_per_pixel], &row[x_in * bytes_per_pixel], bytes_per_pixel);
+        else
+        {
+            uint8_t mask = (1 << bits_per_pixel) - 1;
+            uint8_t val = (row[x_in * bits_per_pixel / 8] >> (8 - (x_in * bits_per_pixel % 8) - bits_per_pixel)) & mask;
+            out_row[x * bits_per_pixel / 8] |= val << (8 - (x * bits_per_pixel % 8) - bits_per_pixel);
+        }
+    }
+}
+
+// IDAT chunks are closed once they grow past this many bytes, so that the compressed stream never has to be buffered in one piece
+static const size_t wpng_idat_chunk_size = (1 << 20);
+
+// closes the IDAT chunk that starts (at its length field) at `chunk_start`, then opens a new one if `reopen` is set
+// the compressor writes straight into `out`, and might be in the middle of a byte; if so, that byte moves into the new chunk
+// returns the start of the new chunk
+static size_t idat_chunk_split(bit_buffer * out, size_t chunk_start, uint8_t reopen)
+{
+    byte_buffer * buf = &out->buffer;
+    uint8_t partial = out->bit_index < 8;
+    uint8_t partial_byte = buf->data[buf->len - 1];
+    if (partial)
+        buf->len -= 1;
+    
+    uint32_t data_size = byteswap_int(buf->len - chunk_start - 8, 4);
+    memcpy(&buf->data[chunk_start], &data_size, 4);
+    bytes_push_int(buf, byteswap_int(defl_compute_crc32(&buf->data[chunk_start + 4], buf->len - chunk_start - 4, 0), 4), 4);
+    
+    size_t next_start = buf->len;
+    if (reopen)
+    {
+        bytes_push_int(buf, 0, 4); // length, filled in when the chunk is closed
+        bytes_push(buf, (const uint8_t *)"IDAT", 4);
+        if (partial)
+            byte_push(buf, partial_byte);
+    }
+    out->byte_index = buf->len - 1;
+    return next_start;
+}
+
+// with WPNG_WRITE_PARALLEL_DECODE, images are split into bands of rows with about this many bytes of scanlines each
+static const size_t wpng_band_size = (1 << 20);
+
+// rows per band for WPNG_WRITE_PARALLEL_DECODE
+static inline uint32_t wpng_band_rows(size_t bytes_per_scanline, uint32_t height)
+{
+    size_t rows = wpng_band_size / (bytes_per_scanline + 1);
+    if (rows < 1)
+        rows = 1;
+    if (rows > height)
+        rows = height;
+    return rows;
+}
+
+// smallest lossless png representation of an image, as found by analyze_reduction
+typedef struct {
+    uint8_t color_type; // 0: y, 2: rgb, 4: ya, 6: rgba
+    uint8_t bit_depth; // 1, 2, 4, 8, or 16. less than 8 only for y
+    uint8_t has_key; // alpha was dropped in favor of a single transparent color (tRNS)
+    uint16_t key[3]; // y or rgb, at the source's sample depth (8 or 16 bit)
+} wpng_reduction;
+
+static inline uint16_t reduction_sample(const uint8_t * px, size_t c, uint8_t is_16bit)
+{
+    return is_16bit ? ((uint16_t)px[c * 2] << 8) | px[c * 2 + 1] : px[c];
+}
+
+// single pass over the image. finds out:
+// - whether 16-bit samples all have matching high and low bytes
+// - whether alpha is always opaque, or is binary with a single color for transparent pixels (usable as a tRNS key)
+// - whether r, g, and b are always equal
+// - the lowest gray bit depth that can hold every sample
+static wpng_reduction analyze_reduction(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline)
+{
+    uint8_t components = is_16bit ? bpp / 2 : bpp;
+    uint8_t has_alpha = components == 2 || components == 4;
+    uint8_t color_count = has_alpha ? components - 1 : components;
+    uint16_t max_val = is_16bit ? 0xFFFF : 0xFF;
+    
+    uint8_t can_8bit = 1;
+    uint8_t is_opaque = 1;
+    uint8_t is_binary_alpha = 1;
+    uint8_t key_ok = 1;
+    uint8_t key_set = 0;
+    uint16_t key[3] = {0, 0, 0};
+    uint8_t is_gray = 1;
+    uint8_t can_1bit = 1;
+    uint8_t can_2bit = 1;
+    uint8_t can_4bit = 1;
+    
+    // hashed set of opaque colors seen before the key was found, for catching key collisions
+    // false positives only cost us the tRNS key reduction, never correctness
+    uint8_t opaque_seen[8192];
+    memset(opaque_seen, 0, sizeof(opaque_seen));
+    
+    for (size_t y = 0; y < height; y += 1)
+    {
+        for (size_t x = 0; x < width; x += 1)
+        {
+            const uint8_t * px = &image_data[y * bytes_per_scanline + x * bpp];
+            uint16_t color[3] = {0, 0, 0};
+            for (size_t c = 0; c < color_count; c += 1)
+                color[c] = reduction_sample(px, c, is_16bit);
+            
+            if (is_16bit && can_8bit)
+            {
+                for (size_t c = 0; c < components; c += 1)
+                    can_8bit &= px[c * 2] == px[c * 2 + 1];
+            }
+            
+            if (color_count == 3)
+                is_gray &= color[0] == color[1] && color[1] == color[2];
+            
+            uint8_t v = is_16bit ? color[0] >> 8 : color[0];
+            can_1bit &= v == 0 || v == 0xFF;
+            can_2bit &= v % 0x55 == 0;
+            can_4bit &= v % 0x11 == 0;
+            
+            if (!has_alpha)
+                continue;
+            
+            uint16_t alpha = reduction_sample(px, components - 1, is_16bit);
+            is_opaque &= alpha == max_val;
+            is_binary_alpha &= alpha == 0 || alpha == max_val;
+            if (!key_ok || !is_binary_alpha)
+                continue;
+            
+            uint8_t is_key = key_set && color[0] == key[0] && color[1] == key[1] && color[2] == key[2];
+            if (alpha == 0)
+            {
+                if (!key_set)
+                {
+                    memcpy(key, color, sizeof(key));
+                    key_set = 1;
+                    uint32_t hash = (uint32_t)(((uint64_t)color[0] << 32 | (uint64_t)color[1] << 16 | color[2]) * 0x9E3779B97F4A7C15 >> 48);
+                    key_ok = !(opaque_seen[hash >> 3] & (1 << (hash & 7)));
+                }
+                else
+                    key_ok = is_key;
+            }
+            else if (key_set)
+                key_ok = !is_key;
+            else
+            {
+                uint32_t hash = (uint32_t)(((uint64_t)color[0] << 32 | (uint64_t)color[1] << 16 | color[2]) * 0x9E3779B97F4A7C15 >> 48);
+                opaque_seen[hash >> 3] |= 1 << (hash & 7);
+            }
+        }
     }
     
+    wpng_reduction ret;
+    memset(&ret, 0, sizeof(ret));
+    
+    uint8_t keep_alpha = has_alpha;
+    if (has_alpha && is_opaque)
+        keep_alpha = 0;
+    else if (has_alpha && is_binary_alpha && key_set && key_ok)
+    {
+        keep_alpha = 0;
+        ret.has_key = 1;
+        memcpy(ret.key, key, sizeof(key));
+    }
+    uint8_t keep_color = color_count == 3 && !is_gray;
+    
+    ret.color_type = keep_color ? (keep_alpha ? 6 : 2) : (keep_alpha ? 4 : 0);
+    ret.bit_depth = is_16bit && !can_8bit ? 16 : 8;
+    if (ret.color_type == 0 && ret.bit_depth == 8)
+        ret.bit_depth = can_1bit ? 1 : can_2bit ? 2 : can_4bit ? 4 : 8;
+    
+    return ret;
+}
+
+// converts an image into the color type given by `reduction`, at 8 or 16 bits per sample
+// sub-8-bit gray is left unpacked at 8 bits per sample; see pack_samples
+static uint8_t * reduce_image(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, const wpng_reduction * reduction, uint8_t * out_bpp)
+{
+    uint8_t components = is_16bit ? bpp / 2 : bpp;
+    uint8_t out_is_16bit = reduction->bit_depth == 16;
+    uint8_t out_components = reduction->color_type == 0 ? 1 : reduction->color_type == 4 ? 2 : reduction->color_type == 2 ? 3 : 4;
+    uint8_t out_alpha = reduction->color_type == 4 || reduction->color_type == 6;
+    
+    *out_bpp = out_components * (out_is_16bit + 1);
+    size_t out_bps = (size_t)width * *out_bpp;
+    uint8_t * output = (uint8_t *)malloc(out_bps * height);
+    assert(output);
+    
+    for (size_t y = 0; y < height; y += 1)
+    {
+        for (size_t x = 0; x < width; x += 1)
+        {
+            const uint8_t * px = &image_data[y * bytes_per_scanline + x * bpp];
+            uint8_t * out = &output[y * out_bps + x * *out_bpp];
+            for (size_t c = 0; c < out_components; c += 1)
+            {
+                // alpha always comes from the last source component, color from the first ones
+                size_t s = (c + 1 == out_components && out_alpha) ? (size_t)(components - 1) : c;
+                if (!is_16bit)
+                    out[c] = px[s];
+                else if (out_is_16bit)
+                {
+                    out[c * 2 + 0] = px[s * 2 + 0];
+                    out[c * 2 + 1] = px[s * 2 + 1];
+                }
+                else
+                    out[c] = px[s * 2];
+            }
+        }
+    }
     return output;
 }
 
 enum {
     WPNG_WRITE_ALLOW_PALLETIZATION = 1,
+    WPNG_WRITE_ALLOW_REDUCTION = 2, // losslessly reduce color type and bit depth (16->8 bit, dropping alpha, rgb->gray, 1/2/4-bit gray)
+    WPNG_WRITE_OPTIMIZE_PALETTE_ORDER = 4, // try several palette orderings and keep whichever compresses best (slower)
+    WPNG_WRITE_INTERLACE = 8, // write an adam7 interlaced image
+    WPNG_WRITE_PARALLEL_DECODE = 16, // split non-interlaced images into independently compressed bands, and index them with a "wpBI" chunk, so wpng_load can decode the bands on several threads at once
 };
-// image_data must refer to at least `bytes_per_scanline * height * bpp` bytes. if is_16bit is zero, bpp must be 1, 2, 3, or 4. if is_16bit is nonzero, bpp must be 2, 4, 6, or 8.
-// compression_quality affects DEFLATE compression speed; lower numbers are faster, except 0, which is fastest (uses DEFLATE's `store` mode).
-static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+// appends a png to `out` like wpng_write_append, but compresses with `stream`, which keeps its buffers afterwards so that the next image can reuse them
+//  (see defl_stream_reset). a stream that's all zeroes gets its buffers on first use; free them with defl_stream_free when done
+static byte_buffer wpng_write_append_stream(defl_stream * stream, byte_buffer out, uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
 {
-    byte_buffer out;
-    memset(&out, 0, sizeof(byte_buffer));
-    
     bytes_push(&out, (const uint8_t *)"\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 8);
     
     //uint8_t * orig_image_data = image_data;
     //uint8_t orig_bpp = bpp;
     //size_t orig_bytes_per_scanline = bytes_per_scanline;
     
+    uint8_t components = is_16bit ? bpp / 2 : bpp;
+    wpng_reduction reduction;
+    memset(&reduction, 0, sizeof(reduction));
+    reduction.color_type = components == 1 ? 0 : components == 2 ? 4 : components == 3 ? 2 : components == 4 ? 6 : 0;
+    reduction.bit_depth = is_16bit ? 16 : 8;
+    
+    uint8_t * reduced = 0;
+    if (flags & WPNG_WRITE_ALLOW_REDUCTION)
+    {
+        reduction = analyze_reduction(width, height, bpp, is_16bit, image_data, bytes_per_scanline);
+        uint8_t reduced_components = reduction.color_type == 0 ? 1 : reduction.color_type == 4 ? 2 : reduction.color_type == 2 ? 3 : 4;
+        if (reduced_components != components || (reduction.bit_depth == 16) != is_16bit)
+        {
+            reduced = reduce_image(width, height, bpp, is_16bit, image_data, bytes_per_scanline, &reduction, &bpp);
+            image_data = reduced;
+            bytes_per_scanline = (size_t)width * bpp;
+        }
+        // tRNS key is stored at the source depth
+        if (reduction.has_key && is_16bit && reduction.bit_depth != 16)
+        {
+            for (size_t i = 0; i < 3; i += 1)
+                reduction.key[i] >>= 8;
+        }
+        is_16bit = reduction.bit_depth == 16;
+    }
+    
     size_t palettized_size = 0;
     uint32_t palette[256] = {0};
     uint32_t pal_count = 0;
     uint32_t pal_depth = 0;
-    uint8_t * palettized = !(flags & WPNG_WRITE_ALLOW_PALLETIZATION) || is_16bit ? 0 : palettize(width, height, bpp, image_data, bytes_per_scanline, &palettized_size, palette, &pal_count, &pal_depth);
+    uint8_t * palettized = 0;
+    if ((flags & WPNG_WRITE_ALLOW_PALLETIZATION) && !is_16bit)
+    {
+        uint32_t raw_key = reduction.color_type == 0 ? reduction.key[0] : ((uint32_t)reduction.key[0] << 16) | (reduction.key[1] << 8) | reduction.key[2];
+        palettized = palettize(width, height, bpp, image_data, bytes_per_scanline, reduction.has_key ? &raw_key : 0, !!(flags & WPNG_WRITE_OPTIMIZE_PALETTE_ORDER), &palettized_size, palette, &pal_count, &pal_depth);
+        // gray is smaller than an equal-depth palette, because it doesn't need a PLTE chunk
+        if (palettized && (flags & WPNG_WRITE_ALLOW_REDUCTION) && reduction.color_type == 0 && pal_depth >= reduction.bit_depth)
+        {
+            free(palettized);
+            palettized = 0;
+        }
+    }
+    if (!palettized && reduction.bit_depth < 8)
+    {
+        size_t packed_size = 0;
+        // every sample is an exact multiple of the lower depth's step size
+        uint8_t lut[256] = {0};
+        for (size_t i = 0; i < 256; i += 1)
+            lut[i] = i / (0xFF / ((1 << reduction.bit_depth) - 1));
+        uint8_t * packed = pack_samples(width, height, image_data, bytes_per_scanline, lut, reduction.bit_depth, &packed_size);
+        free(reduced);
+        reduced = packed;
+        image_data = packed;
+        bpp = 1;
+        bytes_per_scanline = packed_size / height;
+    }
     
     // write header chunk
     
@@ -180,9 +771,8 @@ static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint
     
     if (!palettized)
     {
-        byte_push(&out, is_16bit ? 16 : 8);
-        uint8_t components = is_16bit ? bpp / 2 : bpp;
-        byte_push(&out, components == 1 ? 0 : components == 2 ? 4 : components == 3 ? 2 : components == 4 ? 6 : 0);
+        byte_push(&out, reduction.bit_depth);
+        byte_push(&out, reduction.color_type);
     }
     else
     {
@@ -195,7 +785,7 @@ static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint
     
     byte_push(&out, 0); // compression method (deflate)
     byte_push(&out, 0); // filter method (adaptive x5)
-    byte_push(&out, 0); // interlacing method (none)
+    byte_push(&out, !!(flags & WPNG_WRITE_INTERLACE)); // interlacing method (none or adam7)
     
     size_t chunk_size = out.len - chunk_start;
     bytes_push_int(&out, byteswap_int(defl_compute_crc32(&out.data[chunk_start], chunk_size, 0), 4), 4);
@@ -230,131 +820,273 @@ static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint
         chunk_size = out.len - chunk_start;
         bytes_push_int(&out, byteswap_int(defl_compute_crc32(&out.data[chunk_start], chunk_size, 0), 4), 4);
     }
-    
-    // write IDAT chunks
-    // first, collect pixel data
-    byte_buffer pixel_data;
-    memset(&pixel_data, 0, sizeof(pixel_data));
-    uint64_t num_unfiltered = 0;
-    for (size_t y = 0; y < height; y += 1)
+    else if (reduction.has_key)
     {
-        // pick a filter based on the sum-of-absolutes heuristic
-        size_t start = bytes_per_scanline * y;
+        // transparency chunk (single color key)
+        uint8_t key_count = reduction.color_type == 0 ? 1 : 3;
+        bytes_push_int(&out, byteswap_int(key_count * 2, 4), 4);
         
-        uint64_t sum_abs_null = 0;
-        uint64_t sum_abs_left = 0;
-        uint64_t sum_abs_top = 0;
-        uint64_t sum_abs_avg = 0;
-        uint64_t sum_abs_paeth = 0;
-        
-        uint64_t hit_vals[256] = {0};
-        uint8_t most_common_val = 0;
-        uint64_t most_common_count = 0;
-        
-        if (compression_quality > 0)
+        chunk_start = out.len;
+        bytes_push(&out, (const uint8_t *)"tRNS", 4);
+        for (size_t i = 0; i < key_count; i++)
         {
-            for (size_t x = 0; x < bytes_per_scanline; x++)
-            {
-                uint8_t val = image_data[start + x];
-                hit_vals[val] += 1;
-                if (hit_vals[val] > most_common_count)
-                {
-                    most_common_count = hit_vals[val];
-                    most_common_val = val;
-                }
-            }
-            
-            for (size_t x = 0; x < bytes_per_scanline; x++)
-            {
-                sum_abs_null += abs((int32_t)(int8_t)(image_data[start + x] - most_common_val));
-                
-                uint16_t up   = y >    0 ? image_data[start - bytes_per_scanline + x] : 0;
-                uint16_t left = x >= bpp ? image_data[start + x - bpp] : 0;
-                uint8_t avg = (up + left) / 2;
-                sum_abs_avg += abs((int32_t)(image_data[start + x]) - (int32_t)(avg));
-                
-                sum_abs_left += abs((int32_t)(image_data[start + x]) - (int32_t)left);
-                
-                sum_abs_top += abs((int32_t)(image_data[start + x]) - (int32_t)up);
-                
-                uint8_t ref = paeth_get_ref(image_data, bytes_per_scanline, x, y, bpp);
-                sum_abs_paeth += abs((int32_t)(image_data[start + x]) - (int32_t)(ref));
-            }
+            uint16_t key = reduction.key[i];
+            if (reduction.bit_depth < 8)
+                key /= 0xFF / ((1 << reduction.bit_depth) - 1);
+            bytes_push_int(&out, byteswap_int(key, 2), 2);
         }
         
-        if (y == 0)
-            sum_abs_top = -1;
-        
-        // bias in favor of storing unfiltered if enough (25%) earlier scanlines are stored unfiltered
-        // this helps with deflate's lz77 pass
-        if (num_unfiltered > y / height / 4)
-            sum_abs_null /= 3;
-        
-        if (compression_quality == 0 || (sum_abs_null <= sum_abs_left && sum_abs_null <= sum_abs_top && sum_abs_null <= sum_abs_avg && sum_abs_null <= sum_abs_paeth))
-        {
-            num_unfiltered += 1;
-            //puts("picked filter mode 0");
-            byte_push(&pixel_data, 0); // no filter
-            bytes_push(&pixel_data, &image_data[start], bytes_per_scanline);
-        }
-        else if (sum_abs_left <= sum_abs_top && sum_abs_left <= sum_abs_avg && sum_abs_left <= sum_abs_paeth)
-        {
-            //puts("picked filter mode 1");
-            byte_push(&pixel_data, 1); // left filter
-            for (size_t x = 0; x < bpp; x++)
-                byte_push(&pixel_data, image_data[start + x]);
-            for (size_t x = bpp; x < bytes_per_scanline; x++)
-                byte_push(&pixel_data, image_data[start + x] - image_data[start + x - bpp]);
-        }
-        else if (sum_abs_top <= sum_abs_avg && sum_abs_top <= sum_abs_paeth)
-        {
-            //puts("picked filter mode 2");
-            byte_push(&pixel_data, 2); // top filter
-            for (size_t x = 0; x < bytes_per_scanline; x++)
-                byte_push(&pixel_data, image_data[start + x] - image_data[start - bytes_per_scanline + x]);
-        }
-        else if (sum_abs_avg <= sum_abs_paeth)
+        chunk_size = out.len - chunk_start;
+        bytes_push_int(&out, byteswap_int(defl_compute_crc32(&out.data[chunk_start], chunk_size, 0), 4), 4);
+    }
+    
+    // band index chunk, for WPNG_WRITE_PARALLEL_DECODE: the number of rows per band,
+    //  then for each band after the first, the offset of its first IDAT chunk from the first IDAT chunk (both at their length fields)
+    // each band's compressed data starts at the start of an IDAT chunk, after a full flush, and its first row only uses the none or sub filters,
+    //  so it can be decompressed and defiltered without anything before it
+    // the offsets get filled in as the bands are written
+    uint32_t band_rows = height;
+    if ((flags & WPNG_WRITE_PARALLEL_DECODE) && !(flags & WPNG_WRITE_INTERLACE))
+        band_rows = wpng_band_rows(bytes_per_scanline, height);
+    uint32_t band_count = (height - 1) / band_rows + 1;
+    size_t band_index_start = out.len + 4;
+    if (band_count > 1)
+    {
+        bytes_push_int(&out, byteswap_int(band_count * 4, 4), 4);
+        bytes_push(&out, (const uint8_t *)"wpBI", 4);
+        bytes_push_int(&out, byteswap_int(band_rows, 4), 4);
+        for (size_t i = 0; i < band_count; i++)
+            bytes_push_int(&out, 0, 4); // offsets, then the crc
+    }
+    
+    // `out` outgrew a caller's fixed buffer (see wpng_write_to), so the png can't fit; don't bother compressing anything
+    if (out.overflowed)
+    {
+        free(palettized);
+        free(reduced);
+        return out;
+    }
+    
+    // write IDAT chunks
+    // scanlines are filtered one at a time and fed to the compressor, which writes straight into `out`
+    size_t idat_start = out.len;
+    size_t first_idat_start = idat_start;
+    bytes_push_int(&out, 0, 4); // length, filled in when the chunk is closed
+    bytes_push(&out, (const uint8_t *)"IDAT", 4);
+    bit_buffer idat_out = {out, out.len - 1, 8};
+    
+    defl_stream_reset(stream, compression_quality, 1, idat_out);
+    
+    byte_buffer filtered;
+    memset(&filtered, 0, sizeof(filtered));
+    uint64_t num_unfiltered = 0;
+    if (!(flags & WPNG_WRITE_INTERLACE))
+    {
+        for (size_t y = 0; y < height && !stream->out.buffer.overflowed; y += 1)
         {
-            //puts("picked filter mode 3");
-            byte_push(&pixel_data, 3); // avg filter
-            for (size_t x = 0; x < bytes_per_scanline; x++)
+            uint8_t * row = &image_data[bytes_per_scanline * y];
+            uint8_t is_band_start = y > 0 && y % band_rows == 0;
+            if (is_band_start)
             {
-                uint16_t up   = y >    0 ? image_data[start - bytes_per_scanline + x] : 0;
-                uint16_t left = x >= bpp ? image_data[start + x - bpp] : 0;
-                uint8_t avg = (up + left) / 2;
-                byte_push(&pixel_data, image_data[start + x] - avg);
+                defl_stream_flush(stream, 1);
+                if (stream->out.buffer.len > idat_start + 8)
+                    idat_start = idat_chunk_split(&stream->out, idat_start, 1);
+                uint32_t offset = byteswap_int(idat_start - first_idat_start, 4);
+                memcpy(&stream->out.buffer.data[band_index_start + 8 + (y / band_rows - 1) * 4], &offset, 4);
             }
+            filtered.len = 0;
+            filter_scanline(&filtered, row, y > 0 ? row - bytes_per_scanline : 0, bytes_per_scanline, bpp, compression_quality, &num_unfiltered, y, height, is_band_start);
+            defl_stream_write(stream, filtered.data, filtered.len);
+            if (stream->out.buffer.len - idat_start >= wpng_idat_chunk_size)
+                idat_start = idat_chunk_split(&stream->out, idat_start, 1);
         }
-        else
+    }
+    else
+    {
+        // each pass is filtered as its own image, then all of them go into the same zlib stream
+        // pass rows are pulled out of the image as they're needed, keeping the previous one around for filtering
+        uint8_t bits_per_pixel = palettized ? pal_depth : reduction.bit_depth < 8 ? reduction.bit_depth : bpp * 8;
+        uint8_t * pass_rows = (uint8_t *)malloc(bytes_per_scanline * 2);
+        assert(pass_rows);
+        for (uint8_t pass = 1; pass <= 7 && !stream->out.buffer.overflowed; pass += 1)
         {
-            //puts("picked filter mode 4");
-            byte_push(&pixel_data, 4); // paeth filter
-            for (size_t x = 0; x < bytes_per_scanline; x++)
+            size_t pass_width = adam7_pass_size(width, adam7_x_inits[pass], adam7_x_gaps[pass]);
+            size_t pass_height = adam7_pass_size(height, adam7_y_inits[pass], adam7_y_gaps[pass]);
+            size_t pass_bps = (pass_width * bits_per_pixel + 7) / 8;
+            if (pass_width == 0)
+                continue;
+            for (size_t y = 0; y < pass_height && !stream->out.buffer.overflowed; y += 1)
             {
-                uint8_t ref = paeth_get_ref(image_data, bytes_per_scanline, x, y, bpp);
-                byte_push(&pixel_data, image_data[start + x] - ref);
+                uint8_t * row = &pass_rows[(y & 1) * bytes_per_scanline];
+                uint8_t * prev_row = &pass_rows[(~y & 1) * bytes_per_scanline];
+                interlace_row(&image_data[(y * adam7_y_gaps[pass] + adam7_y_inits[pass]) * bytes_per_scanline], pass_width, bits_per_pixel, pass, row, pass_bps);
+                filtered.len = 0;
+                filter_scanline(&filtered, row, y > 0 ? prev_row : 0, pass_bps, bpp, compression_quality, &num_unfiltered, y, pass_height, 0);
+                defl_stream_write(stream, filtered.data, filtered.len);
+                if (stream->out.buffer.len - idat_start >= wpng_idat_chunk_size)
+                    idat_start = idat_chunk_split(&stream->out, idat_start, 1);
             }
         }
+        free(pass_rows);
     }
+    free(filtered.data);
     
-    bit_buffer pixel_data_comp = do_deflate(pixel_data.data, pixel_data.len, compression_quality, 1);
+    if (stream->out.buffer.overflowed)
+    {
+        free(palettized);
+        free(reduced);
+        return stream->out.buffer;
+    }
     
-    bytes_push_int(&out, byteswap_int(pixel_data_comp.buffer.len, 4), 4);
-    chunk_start = out.len;
-    bytes_push(&out, (const uint8_t *)"IDAT", 4);
-    bytes_push(&out, pixel_data_comp.buffer.data, pixel_data_comp.buffer.len);
-    chunk_size = out.len - chunk_start;
-    bytes_push_int(&out, byteswap_int(defl_compute_crc32(&out.data[chunk_start], chunk_size, 0), 4), 4);
+    defl_stream_end(stream);
+    idat_chunk_split(&stream->out, idat_start, 0);
+    out = stream->out.buffer;
     
-    if (pixel_data_comp.buffer.data)
-        free(pixel_data_comp.buffer.data);
+    if (band_count > 1)
+    {
+        size_t crc_start = band_index_start + 4 + band_count * 4;
+        uint32_t crc = byteswap_int(defl_compute_crc32(&out.data[band_index_start], crc_start - band_index_start, 0), 4);
+        memcpy(&out.data[crc_start], &crc, 4);
+    }
     
     bytes_push_int(&out, 0, 4);
     bytes_push(&out, (const uint8_t *)"IEND\xAE\x42\x60\x82", 8);
     
     free(palettized);
+    free(reduced);
     
     return out;
 }
 
+// appends a png to `out`, see wpng_write
+static byte_buffer wpng_write_append(byte_buffer out, uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+{
+    defl_stream stream;
+    memset(&stream, 0, sizeof(defl_stream));
+    out = wpng_write_append_stream(&stream, out, width, height, bpp, is_16bit, image_data, bytes_per_scanline, flags, compression_quality);
+    defl_stream_free(&stream);
+    return out;
+}
+
+// image_data must refer to at least `bytes_per_scanline * height * bpp` bytes. if is_16bit is zero, bpp must be 1, 2, 3, or 4. if is_16bit is nonzero, bpp must be 2, 4, 6, or 8.
+// compression_quality affects DEFLATE compression speed; lower numbers are faster, except 0, which is fastest (uses DEFLATE's `store` mode).
+static byte_buffer wpng_write(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+{
+    byte_buffer out;
+    memset(&out, 0, sizeof(byte_buffer));
+    return wpng_write_append(out, width, height, bpp, is_16bit, image_data, bytes_per_scanline, flags, compression_quality);
+}
+
+// worst-case size of the png that wpng_write produces for an image of this format, with any flags and compression quality
+// returns 0 if it doesn't fit in a size_t
+static inline size_t wpng_write_bound(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit)
+{
+    (void)is_16bit; // bpp already counts bytes, not samples
+    if (width == 0 || height == 0)
+        return 0;
+    
+    // filtered scanlines: one filter byte per row, for the whole image or for each adam7 pass, whichever is bigger
+    uint64_t raw_size = (uint64_t)height * ((uint64_t)width * bpp + 1);
+    uint64_t interlaced_size = 0;
+    for (uint8_t pass = 1; pass <= 7; pass += 1)
+    {
+        uint64_t pass_width = adam7_pass_size(width, adam7_x_inits[pass], adam7_x_gaps[pass]);
+        uint64_t pass_height = adam7_pass_size(height, adam7_y_inits[pass], adam7_y_gaps[pass]);
+        if (pass_width > 0)
+            interlaced_size += pass_height * (pass_width * bpp + 1);
+    }
+    if (interlaced_size > raw_size)
+        raw_size = interlaced_size;
+    
+    uint64_t zlib_size = defl_bound(raw_size);
+    uint64_t idat_count = zlib_size / wpng_idat_chunk_size + 1;
+    // with WPNG_WRITE_PARALLEL_DECODE, each band adds an index entry, an IDAT chunk, a flush, and maybe a stored block header
+    uint64_t band_count = ((uint64_t)height - 1) / wpng_band_rows((size_t)width * bpp, height) + 1;
+    // signature, IHDR, sRGB, the biggest possible PLTE and tRNS, band index, IDATs, IEND
+    uint64_t size = 8 + 25 + 13 + (12 + 256 * 3) + (12 + 256) + (12 + band_count * 4) + (idat_count + band_count) * 12 + band_count * 11 + zlib_size + 12;
+    if (size > (size_t)-1)
+        return 0;
+    return size;
+}
+
+// like wpng_write, but writes the png into `dest` instead of a new allocation
+// returns the size of the png, or 0 if it didn't fit in `dest_size` bytes. a buffer of wpng_write_bound bytes always fits.
+static inline size_t wpng_write_to(uint8_t * dest, size_t dest_size, uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, uint32_t flags, int8_t compression_quality)
+{
+    byte_buffer out;
+    memset(&out, 0, sizeof(byte_buffer));
+    out.data = dest;
+    out.cap = dest_size;
+    out.fixed = 1;
+    out = wpng_write_append(out, width, height, bpp, is_16bit, image_data, bytes_per_scanline, flags, compression_quality);
+    if (out.overflowed)
+    {
+        free(out.data);
+        return 0;
+    }
+    return out.len;
+}
+
+// an image for wpng_write_batch; the fields mean the same as wpng_write's arguments
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bpp;
+    uint8_t is_16bit;
+    uint8_t * image_data;
+    size_t bytes_per_scanline;
+} wpng_write_image;
+
+typedef struct {
+    const wpng_write_image * images;
+    uint32_t flags;
+    int8_t compression_quality;
+    byte_buffer * outputs;
+    const wpng_task_size * order; // null to go in the order they were given in
+    defl_stream * streams; // one per thread, so each thread's compressor buffers get reused for all of its images
+} wpng_write_batch_job;
+
+static void wpng_write_batch_image(void * userdata, size_t index, uint32_t thread)
+{
+    wpng_write_batch_job * job = (wpng_write_batch_job *)userdata;
+    size_t i = job->order ? job->order[index].index : index;
+    const wpng_write_image * image = &job->images[i];
+    byte_buffer out;
+    memset(&out, 0, sizeof(byte_buffer));
+    job->outputs[i] = wpng_write_append_stream(&job->streams[thread], out, image->width, image->height, image->bpp, image->is_16bit, image->image_data, image->bytes_per_scanline, job->flags, job->compression_quality);
+}
+
+// writes images[i] into outputs[i] for every i in [0, count), like wpng_write, on up to one thread per cpu core at once (see wpng_thread.h)
+// the biggest images are started first, so that one left over at the end doesn't keep every other thread waiting for it
+static inline void wpng_write_batch(const wpng_write_image * images, size_t count, uint32_t flags, int8_t compression_quality, byte_buffer * outputs)
+{
+    wpng_write_batch_job job;
+    job.images = images;
+    job.flags = flags;
+    job.compression_quality = compression_quality;
+    job.outputs = outputs;
+    job.order = 0;
+    // (if there's no memory for this, the images just go in the order they're in)
+    wpng_task_size * order = count > 1 ? (wpng_task_size *)malloc(sizeof(wpng_task_size) * count) : 0;
+    if (order)
+    {
+        for (size_t i = 0; i < count; i += 1)
+        {
+            order[i].size = (uint64_t)images[i].height * images[i].bytes_per_scanline;
+            order[i].index = i;
+        }
+        wpng_task_sort(order, count);
+        job.order = order;
+    }
+    uint32_t thread_count = wpng_thread_count();
+    job.streams = (defl_stream *)malloc(sizeof(defl_stream) * thread_count);
+    assert(job.streams);
+    memset(job.streams, 0, sizeof(defl_stream) * thread_count);
+    wpng_parallel_for(count, thread_count, wpng_write_batch_image, &job);
+    for (uint32_t t = 0; t < thread_count; t += 1)
+        defl_stream_free(&job.streams[t]);
+    free(job.streams);
+    free(order);
+}
+
 #endif //WPNG_WRITE_INCLUDED